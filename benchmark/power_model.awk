@@ -0,0 +1,80 @@
+#!/usr/bin/awk -f
+# Copyright © 2017-2018, Lukas Werling
+# 
+# Permission to use, copy, modify, and/or distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+# 
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+# Fits a power model for libswp_migrate's $SWP_POWER_MODEL from a benchmark run
+# with RUN_POWER_MODEL=1. Usage:
+#
+#     gawk -f power_model.awk analysis/<name>/power_log.tsv > power-model.txt
+#
+# Power values are RAPL package power above the idle package power. The
+# compute speedup is the duration ratio of the CPU-only runs. The migration
+# energy assumes `migrations` migrations per ultoverhead run.
+
+BEGIN {
+	FS = "\t";
+	migrations = migrations ? migrations : 10000000;
+}
+
+function mktime_iso(time) {
+	gsub(/[-T:]|[,+][0-9:]+/, " ", time);
+	return mktime(time)
+}
+
+NR == 1 {
+	for (i = 1; i <= NF; i++)
+		col[$i] = i;
+	next
+}
+
+{
+	package = $col["package"];
+	duration = mktime_iso($col["time_end"]) - mktime_iso($col["time_start"]);
+}
+
+$1 == "idle" {
+	idle += package;
+	nidle++;
+}
+
+$1 ~ /^power model (fast|slow) (cpu|memory)$/ {
+	split($1, t, " ");
+	key = t[3] " " t[4];
+	power[key] += package;
+	npower[key]++;
+	time[key] += duration;
+}
+
+$1 == "power model migration" {
+	mig_energy += package * duration;
+	mig_time += duration;
+	nmig++;
+}
+
+END {
+	if (!nidle || !npower["fast cpu"] || !npower["slow cpu"] || !npower["fast memory"] || !npower["slow memory"]) {
+		print "missing idle or power model runs" > "/dev/stderr";
+		exit 1;
+	}
+	idle /= nidle;
+	split("fast slow", classes, " ");
+	for (i = 1; i <= 2; i++) {
+		class = classes[i];
+		print class, "compute", power[class " cpu"] / npower[class " cpu"] - idle;
+		print class, "memory", power[class " memory"] / npower[class " memory"] - idle;
+	}
+	print "compute", "speedup", time["slow cpu"] / time["fast cpu"];
+	if (nmig)
+		print "migration", (mig_energy - idle * mig_time) / (nmig * migrations);
+}
@@ -38,8 +38,22 @@ BEGIN {
 	}
 }
 
+# Present with SWP_PROFILE_MODE=alternate or random.
+/^\s+speedup / {
+	node_speedup[start] += calls * $3;
+	node_speedup_calls[start] += calls;
+}
+
 END {
 	for (node in node_miss_rate) {
-		print "\"" node "\"", node_miss_rate[node] / node_calls[node];
+		if (node in node_speedup_calls)
+			print "\"" node "\"", node_miss_rate[node] / node_calls[node], node_speedup[node] / node_speedup_calls[node];
+		else
+			print "\"" node "\"", node_miss_rate[node] / node_calls[node];
+	}
+	# Nodes whose miss rates were all discarded still have a valid speedup.
+	for (node in node_speedup_calls) {
+		if (!(node in node_miss_rate))
+			print "\"" node "\"", 0, node_speedup[node] / node_speedup_calls[node];
 	}
 }
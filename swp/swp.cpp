@@ -18,30 +18,147 @@
  * developer-defined points. */
 
 #include "swp.h"
+#include "swp_energy.h"
 #include "swp_util.h"
+#include "../ultmigration.h"
 
 #include <likwid.h>
 
 #include <inttypes.h>
+#include <pthread.h>
 #include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <x86intrin.h>
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
 #include <map>
+#include <mutex>
+#include <new>
 #include <string>
 #include <utility>
+#include <vector>
 
 struct CtrState {
 	double instructions = 0, cycles = 0, l2stat = 0, l3misses = 0;
+	double joules = 0;
 	uint64_t calls = 0;
+	// Split by the core class the section ran on. Only filled in when
+	// profiling with $SWP_PROFILE_MODE.
+	double type_instructions[ULT_TYPE_MAX] = {}, type_cycles[ULT_TYPE_MAX] = {};
+	double type_ticks[ULT_TYPE_MAX] = {};
+	uint64_t type_calls[ULT_TYPE_MAX] = {};
 };
 
-static std::map<std::pair<std::string, std::string>, CtrState> sections;
-static std::string section_start;
+// Position of a mark. The strings are not copied, so they have to stay valid
+// until swp_deinit() (SWP_MARK only passes string literals). Positions are
+// ordered by address, which only std::less defines for unrelated pointers.
+struct Position {
+	const char *id = nullptr, *pos = nullptr;
 
-// Likwid state
+	bool operator<(const Position& other) const {
+		std::less<const char*> less;
+		return id != other.id ? less(id, other.id) : less(pos, other.pos);
+	}
+};
+
+// A single executed section, passed from the application thread to the
+// aggregator thread.
+struct Record {
+	Position start, end;
+	double instructions, cycles, l2stat, l3misses;
+	double ticks; // TSC cycles
+	int type;     // ult_thread_type
+};
+
+// Single-producer single-consumer ring buffer of records. Each application
+// thread owns one, the aggregator thread drains all of them.
+struct Ring {
+	static constexpr size_t size = 4096;
+
+	alignas(64) std::atomic<size_t> head{0}; // written by the application
+	alignas(64) std::atomic<size_t> tail{0}; // written by the aggregator
+	// State of the running section, only accessed by the application.
+	Position section_start;
+	uint64_t section_tsc = 0;
+	ult_thread_type type = ULT_FAST;
+	// Number of sections started at each position, for alternating profiling.
+	std::map<Position, unsigned> visits;
+	unsigned seed = 0;
+	uint64_t stalls = 0;
+	Record records[size];
+
+	void push(const Record& record) {
+		size_t h = head.load(std::memory_order_relaxed);
+		while (h - tail.load(std::memory_order_acquire) == size) {
+			stalls++;
+			sched_yield();
+		}
+		records[h % size] = record;
+		head.store(h + 1, std::memory_order_release);
+	}
+
+	// C++14 new doesn't respect the alignment.
+	static Ring *create() {
+		return new (aligned_alloc(alignof(Ring), sizeof(Ring))) Ring;
+	}
+
+	static void destroy(Ring *ring) {
+		ring->~Ring();
+		free(ring);
+	}
+};
+
+// Rings are created on the first mark of each thread. The generation is
+// odd between swp_init() and swp_deinit(), so that threads notice rings
+// that were freed by a previous swp_deinit().
+static std::mutex rings_mutex;
+static std::vector<Ring*> rings;
+static std::atomic<unsigned> generation;
+static thread_local Ring *ring;
+static thread_local unsigned ring_generation;
+
+// Aggregated sections, only accessed by the aggregator thread until it stops.
+static std::map<std::pair<Position, Position>, CtrState> sections;
+
+static pthread_t aggregator;
+static std::atomic<bool> aggregator_stop;
+
+// Energy of the measured cores, summed over the CPUs of each core class (only
+// ULT_FAST in the fixed profile mode). Marks don't read the counters, which would
+// cost a system call each. Instead, the aggregator reads them on every pass
+// and splits the energy since the previous pass among the sections drained
+// in it, weighted by their TSC ticks. Energy of passes without any finished
+// section is carried over to the next one, so long sections get the energy
+// of their whole run time. Without per-core counters, both classes share
+// the domain of the fast one, which is split among the sections of both.
+static std::deque<swp::EnergyCounter> energy[ULT_TYPE_MAX];
+static swp::EnergyCounter::Domain energy_domain[ULT_TYPE_MAX];
+static bool energy_enabled[ULT_TYPE_MAX];
+static bool energy_shared;
+static double energy_last[ULT_TYPE_MAX];
+
+// Likwid state. Likwid counts per CPU, so every CPU that a section may run
+// on is measured: the CPU of swp_init() in the fixed profile mode, otherwise
+// all CPUs of both core classes, as libultmigration may pick any pool thread
+// of a class.
 static int *cpulist;
 static int group_id;
+static std::vector<int> measured;
+
+// With $SWP_PROFILE_MODE set, sections run on both core classes so that the
+// output contains per-class IPC and a speedup factor for each section.
+enum class ProfileMode {
+	fixed,     // stay on the CPU swp_init() was called on
+	alternate, // alternate between the classes on each start position
+	random,    // pick a random class for each section
+};
+static ProfileMode profile_mode;
 
 // Position in this list has to correspond to the Events enum.
 static const char *event_str_ryzen = "RETIRED_INSTRUCTIONS:PMC0,CPU_CLOCKS_UNHALTED:PMC1,L2_LATENCY_CYCLES_WAIT_ON_FILLS:PMC2,L3_MISS:CPMC5";
@@ -54,9 +171,28 @@ enum class Events : int {
 };
 
 static void print_sections() {
+	// Different positions may map to the same name, so merge by name first.
+	std::map<std::pair<std::string, std::string>, CtrState> named;
+	for (const auto& kv : sections) {
+		auto& state = named[{swp::section_name(kv.first.first.id, kv.first.first.pos),
+		                     swp::section_name(kv.first.second.id, kv.first.second.pos)}];
+		state.calls += kv.second.calls;
+		state.instructions += kv.second.instructions;
+		state.cycles += kv.second.cycles;
+		state.l2stat += kv.second.l2stat;
+		state.l3misses += kv.second.l3misses;
+		state.joules += kv.second.joules;
+		for (int t = 0; t < ULT_TYPE_MAX; t++) {
+			state.type_calls[t] += kv.second.type_calls[t];
+			state.type_instructions[t] += kv.second.type_instructions[t];
+			state.type_cycles[t] += kv.second.type_cycles[t];
+			state.type_ticks[t] += kv.second.type_ticks[t];
+		}
+	}
+
 	// Needed to make thousands grouping work below.
 	setlocale(LC_ALL, "");
-	for (const auto& kv : sections) {
+	for (const auto& kv : named) {
 		const auto& section = kv.first;
 		const auto& state = kv.second;
 		printf("%s -> %s\n\tcalls = %'" PRIu64 "\n\tmiss rate = %f (l3miss = %'.0f / instr = %'.0f)\n\tCPI = %f\n\tL2 rate = %f\n",
@@ -66,7 +202,141 @@ static void print_sections() {
 				state.l3misses, state.instructions,
 				state.cycles / state.instructions,
 				state.l2stat / state.instructions);
+		if (state.joules > 0)
+			printf("\tenergy = %f J (%f mJ/call)\n", state.joules, state.joules * 1000 / state.calls);
+		if (profile_mode == ProfileMode::fixed)
+			continue;
+		// Instructions per TSC cycle include the frequency difference between
+		// the classes, so their ratio is the actual speedup of the section.
+		double ipt[ULT_TYPE_MAX];
+		for (int t = 0; t < ULT_TYPE_MAX; t++) {
+			ipt[t] = state.type_instructions[t] / state.type_ticks[t];
+			if (state.type_calls[t] == 0)
+				continue;
+			printf("\t%s: calls = %'" PRIu64 ", IPC = %f, instr/tick = %f\n",
+					t == ULT_FAST ? "fast" : "slow", state.type_calls[t],
+					state.type_instructions[t] / state.type_cycles[t], ipt[t]);
+		}
+		if (state.type_calls[ULT_FAST] && state.type_calls[ULT_SLOW])
+			printf("\tspeedup = %f\n", ipt[ULT_FAST] / ipt[ULT_SLOW]);
+	}
+}
+
+// Energy of a core class in joules since its counters were opened.
+static double class_joules(int type) {
+	double joules = 0;
+	for (auto& counter : energy[type])
+		joules += counter.joules(energy_domain[type]);
+	return joules;
+}
+
+static void init_energy(const std::vector<std::vector<int>>& classes) {
+	if (!swp::env_ulong("SWP_ENERGY", 1))
+		return;
+	for (size_t t = 0; t < classes.size(); t++) {
+		for (int cpu : classes[t]) {
+			energy[t].emplace_back();
+			if (!energy[t].back().open(cpu)) {
+				fprintf(stderr, "swp: No energy counters for CPU %d, not measuring energy\n", cpu);
+				energy[t].clear();
+				break;
+			}
+			// Powercap has only a package-wide core domain.
+			energy_domain[t] = energy[t].front().available(swp::EnergyCounter::core) ? swp::EnergyCounter::core : swp::EnergyCounter::package;
+			// A domain that isn't per core already counts the other CPUs.
+			if (!energy[t].front().per_core(energy_domain[t]))
+				break;
+		}
+		if (energy[t].empty())
+			continue;
+		energy_last[t] = class_joules(t);
+		energy_enabled[t] = true;
+		// A shared domain already counts the other class, reading it again
+		// would count its energy twice.
+		if (t == ULT_FAST && classes.size() > 1 && !energy[t].front().per_core(energy_domain[t])) {
+			energy_shared = true;
+			break;
+		}
+	}
+}
+
+// Moves all records from the rings to `sections`.
+static void drain_rings() {
+	std::lock_guard<std::mutex> lock(rings_mutex);
+	// Energy since the last pass with finished sections, the ticks of the
+	// sections finished now, and the ticks the energy is split among.
+	double joules[ULT_TYPE_MAX] = {}, ticks[ULT_TYPE_MAX] = {}, split[ULT_TYPE_MAX] = {};
+	std::vector<size_t> heads;
+	for (Ring *r : rings) {
+		size_t t = r->tail.load(std::memory_order_relaxed);
+		size_t h = r->head.load(std::memory_order_acquire);
+		for (; t != h; t++) {
+			const Record& record = r->records[t % Ring::size];
+			ticks[record.type] += record.ticks;
+		}
+		heads.push_back(h);
+	}
+	for (int type = 0; type < ULT_TYPE_MAX; type++) {
+		if (!energy_enabled[type])
+			continue;
+		// Read even without finished sections, as the hardware counters wrap
+		// around.
+		double now = class_joules(type);
+		split[type] = energy_shared ? ticks[ULT_FAST] + ticks[ULT_SLOW] : ticks[type];
+		if (split[type] == 0)
+			continue;
+		joules[type] = now - energy_last[type];
+		energy_last[type] = now;
+	}
+	if (energy_shared) {
+		joules[ULT_SLOW] = joules[ULT_FAST];
+		split[ULT_SLOW] = split[ULT_FAST];
 	}
+
+	for (size_t i = 0; i < rings.size(); i++) {
+		Ring *r = rings[i];
+		size_t t = r->tail.load(std::memory_order_relaxed);
+		size_t h = heads[i];
+		for (; t != h; t++) {
+			const Record& record = r->records[t % Ring::size];
+			auto& state = sections[{record.start, record.end}];
+			state.calls++;
+			if (split[record.type] > 0)
+				state.joules += joules[record.type] * record.ticks / split[record.type];
+			state.instructions += record.instructions;
+			state.cycles += record.cycles;
+			state.l2stat += record.l2stat;
+			state.l3misses += record.l3misses;
+			state.type_calls[record.type]++;
+			state.type_instructions[record.type] += record.instructions;
+			state.type_cycles[record.type] += record.cycles;
+			state.type_ticks[record.type] += record.ticks;
+		}
+		r->tail.store(t, std::memory_order_release);
+	}
+}
+
+static void *aggregator_main(void *) {
+	useconds_t interval = swp::env_ulong("SWP_AGGREGATE_US", 1000);
+	while (!aggregator_stop.load(std::memory_order_relaxed)) {
+		drain_rings();
+		usleep(interval);
+	}
+	drain_rings();
+	return nullptr;
+}
+
+static void stop_aggregator() {
+	aggregator_stop.store(true, std::memory_order_relaxed);
+	pthread_join(aggregator, nullptr);
+	uint64_t stalls = 0;
+	for (Ring *r : rings) {
+		stalls += r->stalls;
+		Ring::destroy(r);
+	}
+	rings.clear();
+	if (stalls)
+		fprintf(stderr, "swp: application threads waited %" PRIu64 " times for the aggregator\n", stalls);
 }
 
 // Resets and starts counters.
@@ -84,8 +354,57 @@ static void init_counters(int group_id) {
 	}
 }
 
+static ProfileMode read_profile_mode() {
+	const char *mode = getenv("SWP_PROFILE_MODE");
+	if (!mode || !*mode || !strcmp(mode, "fixed"))
+		return ProfileMode::fixed;
+	if (!strcmp(mode, "alternate"))
+		return ProfileMode::alternate;
+	if (!strcmp(mode, "random"))
+		return ProfileMode::random;
+	fprintf(stderr, "swp: Unknown $SWP_PROFILE_MODE %s (fixed, alternate, random)\n", mode);
+	exit(-1);
+}
+
+// Returns the CPUs of the core class, which libultmigration migrates to.
+static std::vector<int> class_cpus(int type) {
+	std::vector<int> cpus = swp::class_cpus(type == ULT_SLOW);
+	if (cpus.empty()) {
+		fprintf(stderr, "swp: $%s is required with $SWP_PROFILE_MODE\n",
+				type == ULT_FAST ? "FAST_CPU" : "SLOW_CPU");
+		exit(-1);
+	}
+	return cpus;
+}
+
+// Returns the likwid index of the CPU this thread runs on, or -1 if it isn't
+// measured, e.g., after libultmigration followed a cpuset change.
+static int measured_index() {
+	if (profile_mode == ProfileMode::fixed)
+		return 0;
+	auto it = std::find(measured.begin(), measured.end(), sched_getcpu());
+	return it != measured.end() ? it - measured.begin() : -1;
+}
+
+// Picks the core class for the section starting at `pos`.
+static ult_thread_type next_type(const Position& pos) {
+	unsigned n = profile_mode == ProfileMode::random ? rand_r(&ring->seed) : ring->visits[pos]++;
+	return static_cast<ult_thread_type>(n % ULT_TYPE_MAX);
+}
+
+// Gives this thread a ring whose first section starts at `start`.
+static void create_ring(const Position& start, unsigned g) {
+	ring = Ring::create();
+	ring->section_start = start;
+	ring_generation = g;
+	std::lock_guard<std::mutex> lock(rings_mutex);
+	rings.push_back(ring);
+}
+
 extern "C" void swp_init() {
-	section_start = "swp_init";
+	profile_mode = read_profile_mode();
+	unsigned g = generation.load(std::memory_order_relaxed) + 1;
+	create_ring({"swp_init", nullptr}, g);
 
 	// Initialize Likwid.
 	int err;
@@ -109,11 +428,28 @@ extern "C" void swp_init() {
 	//for (int i = 0; i < topo->numHWThreads; i++)
 	//	cpulist[i] = topo->threadPool[i].apicId;
 	// TODO: Properly support multiple threads.
-	int cpu = sched_getcpu();
-	likwid_pinProcess(cpu);
-	cpulist[0] = topo->threadPool[cpu].apicId;
+	std::vector<std::vector<int>> classes;
+	if (profile_mode == ProfileMode::fixed) {
+		measured.push_back(sched_getcpu());
+		likwid_pinProcess(measured[0]);
+		classes.push_back(measured);
+	} else {
+		for (int t = 0; t < ULT_TYPE_MAX; t++) {
+			classes.push_back(class_cpus(t));
+			for (int cpu : classes.back())
+				if (std::find(measured.begin(), measured.end(), cpu) == measured.end())
+					measured.push_back(cpu);
+		}
+	}
+	for (size_t i = 0; i < measured.size(); i++) {
+		if (measured[i] < 0 || measured[i] >= (int) topo->numHWThreads) {
+			fprintf(stderr, "swp: Invalid CPU %d\n", measured[i]);
+			exit(-1);
+		}
+		cpulist[i] = topo->threadPool[measured[i]].apicId;
+	}
 	//err = perfmon_init(topo->numHWThreads, cpulist);
-	err = perfmon_init(1, cpulist);
+	err = perfmon_init(measured.size(), cpulist);
 	if (err < 0) {
 		fprintf(stderr, "swp: Failed to initialize LIKWID's performance monitoring module\n");
 		exit(-1);
@@ -123,11 +459,34 @@ extern "C" void swp_init() {
 		fprintf(stderr, "swp: Failed to add event string %s to LIKWID's performance monitoring module\n", event_str);
 		exit(-1);
 	}
+	init_energy(classes);
+	aggregator_stop.store(false, std::memory_order_relaxed);
+	aggregator = swp::start_housekeeping_thread(aggregator_main, measured);
+	if (profile_mode != ProfileMode::fixed) {
+		ring->seed = getpid();
+		// Registering starts the ULT on the fast core.
+		ult_register_klt();
+		ring->type = ULT_FAST;
+	}
 	init_counters(group_id);
+	ring->section_tsc = __rdtsc();
+	generation.store(g, std::memory_order_release);
 }
 
 extern "C" void swp_mark(const char *id, const char *pos) {
-	if (section_start.empty()) return;
+	unsigned g = generation.load(std::memory_order_acquire);
+	if (!(g & 1))
+		return;
+	if (ring_generation != g) {
+		// Other threads aren't registered with libultmigration and therefore
+		// only take part in the fixed profile mode. Their first mark starts
+		// a section.
+		if (profile_mode == ProfileMode::fixed) {
+			create_ring({id, pos}, g);
+			ring->section_tsc = __rdtsc();
+		}
+		return;
+	}
 
 	int err;
 	err = perfmon_stopCounters();
@@ -137,22 +496,58 @@ extern "C" void swp_mark(const char *id, const char *pos) {
 		return;
 	}
 
-	std::string section_end = swp::section_name(id, pos);
-	auto& state = sections[{section_start, section_end}];
-	state.calls++;
-	state.instructions += perfmon_getLastResult(group_id, static_cast<int>(Events::instructions), 0);
-	state.cycles += perfmon_getLastResult(group_id, static_cast<int>(Events::cycles), 0);
-	state.l2stat += perfmon_getLastResult(group_id, static_cast<int>(Events::l2stat), 0);
-	state.l3misses += perfmon_getLastResult(group_id, static_cast<int>(Events::l3misses), 0);
-	section_start = std::move(section_end);
+	Record record;
+	record.ticks = __rdtsc() - ring->section_tsc;
+	record.type = ring->type;
+	record.start = ring->section_start;
+	record.end = {id, pos};
+	// The section ran on the CPU of the pool thread that runs the ULT now.
+	// Sections on CPUs that aren't measured are dropped.
+	int cpu = measured_index();
+	if (cpu >= 0) {
+		record.instructions = perfmon_getLastResult(group_id, static_cast<int>(Events::instructions), cpu);
+		record.cycles = perfmon_getLastResult(group_id, static_cast<int>(Events::cycles), cpu);
+		record.l2stat = perfmon_getLastResult(group_id, static_cast<int>(Events::l2stat), cpu);
+		record.l3misses = perfmon_getLastResult(group_id, static_cast<int>(Events::l3misses), cpu);
+		ring->push(record);
+	}
+	ring->section_start = record.end;
+
+	// Migrate while the counters are stopped so that the migration itself
+	// isn't attributed to any section.
+	if (profile_mode != ProfileMode::fixed) {
+		ring->type = next_type(record.end);
+		ult_migrate(ring->type);
+	}
 
 	init_counters(group_id);
+	ring->section_tsc = __rdtsc();
+}
+
+extern "C" void swp_mark_site(swp_site *site) {
+	swp_mark(site->id, site->pos);
+}
+
+// Phases are recorded as two regular marks. The hint only matters for
+// libswp_migrate.
+extern "C" void swp_phase_enter(swp_phase_site *site, int hint) {
+	swp_mark(site->site.id, nullptr);
+}
+
+extern "C" void swp_phase_exit(swp_phase_site *site) {
+	swp_mark(site->site.id, "exit");
 }
 
 extern "C" void swp_deinit() {
 	swp_mark("swp_deinit", nullptr);
+	generation.fetch_add(1, std::memory_order_relaxed);
+	if (profile_mode != ProfileMode::fixed)
+		ult_unregister_klt();
+	stop_aggregator();
+	ring = nullptr;
 
 	delete[] cpulist;
+	measured.clear();
 	perfmon_finalize();
 	topology_finalize();
 
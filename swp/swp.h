@@ -19,20 +19,153 @@
 #ifndef SWP_H
 #define SWP_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// Core class hints for scoped phases. The values match enum ult_thread_type.
+#define SWP_HINT_NONE -1
+#define SWP_HINT_FAST 0
+#define SWP_HINT_SLOW 1
+
 #define SWP_STRINGIZE(x) SWP_DO_STRINGIZE(x)
 #define SWP_DO_STRINGIZE(x) #x
-#define SWP_MARK swp_mark(__func__, __FILE__ ":" SWP_STRINGIZE(__LINE__))
 
+// Define SWP_DISABLE to compile all switching points to nothing. The
+// application then doesn't have to link with any of the swp libraries.
+#ifndef SWP_DISABLE
+
+// State of a single SWP_MARK call site. Libraries may clear `enabled` to skip
+// a site, leaving only a load and a predictable branch at the call site.
+struct swp_site {
+	int enabled;
+	const char *id, *pos;
+	void *state; // owned by the library
+};
+
+#define SWP_MARK do { \
+	static struct swp_site swp_site_ = {1, __func__, __FILE__ ":" SWP_STRINGIZE(__LINE__), 0}; \
+	if (__builtin_expect(__atomic_load_n(&swp_site_.enabled, __ATOMIC_RELAXED), 1)) \
+		swp_mark_site(&swp_site_); \
+} while (0)
+
+// Call site of a scoped phase, see swp::Phase below. `site.id` is the phase
+// name, `hash` is swp::phase_hash() of it and identifies the phase without
+// string operations. Clearing `site.enabled` skips both entry and exit.
+struct swp_phase_site {
+	struct swp_site site;
+	uint64_t hash;
+};
+
+// libswp keeps the `id` and `pos` pointers of swp_mark() until swp_deinit()
+// instead of copying the strings, so they have to stay valid that long.
+// SWP_MARK and the phases only pass string literals.
 void swp_init();
 void swp_mark(const char *id, const char *pos);
+void swp_mark_site(struct swp_site *site);
 void swp_deinit();
 
+void swp_phase_enter(struct swp_phase_site *site, int hint);
+void swp_phase_exit(struct swp_phase_site *site);
+
+#else
+
+#define SWP_MARK ((void) 0)
+
+static inline void swp_init() {}
+static inline void swp_mark(const char *id, const char *pos) {}
+static inline void swp_deinit() {}
+
+#endif
+
 #ifdef __cplusplus
 }
+
+namespace swp {
+
+enum class Core : int {
+	any = SWP_HINT_NONE,
+	fast = SWP_HINT_FAST,
+	slow = SWP_HINT_SLOW,
+};
+
+// 64 bit FNV-1a hash.
+constexpr uint64_t phase_hash(const char *name) {
+	uint64_t hash = 0xcbf29ce484222325;
+	for (; *name; name++)
+		hash = (hash ^ static_cast<uint8_t>(*name)) * 0x100000001b3;
+	return hash;
+}
+
+// Passing the hash as template argument forces the compiler to compute it at
+// compile time, also before C++20.
+template <uint64_t Hash>
+struct PhaseHash {
+	static constexpr uint64_t value = Hash;
+};
+
+#ifndef SWP_DISABLE
+// Static state of the phase call site, like SWP_MARK's. `name` has to be a
+// string literal.
+#define SWP_PHASE_SITE(name) ([]() -> struct swp_phase_site& { \
+	static struct swp_phase_site swp_phase_site_ = \
+		{{1, name, nullptr, nullptr}, ::swp::PhaseHash<::swp::phase_hash(name)>::value}; \
+	return swp_phase_site_; \
+}())
+#else
+struct PhaseSite { };
+#define SWP_PHASE_SITE(name) (::swp::PhaseSite())
+#endif
+
+// Marks a phase for the lifetime of the object:
+//
+//     SWP_PHASE(p, "btree_lookup");
+//     swp::BasicPhase<swp::Core::slow> q{SWP_PHASE_SITE("btree_scan")};
+//
+// The constructor is a switching point named "btree_lookup", the destructor
+// one named "btree_lookup [exit]". When leaving the scope, libswp_migrate
+// returns to the core class of the enclosing phase unless the profile says
+// otherwise. `Hint` is the expected core class, used when the profile doesn't
+// contain the phase.
+template <Core Hint>
+class BasicPhase {
+public:
+#ifndef SWP_DISABLE
+	explicit BasicPhase(struct swp_phase_site& site) {
+		if (__builtin_expect(__atomic_load_n(&site.site.enabled, __ATOMIC_RELAXED), 1)) {
+			entered = &site;
+			swp_phase_enter(&site, static_cast<int>(Hint));
+		}
+	}
+
+	~BasicPhase() {
+		if (entered)
+			swp_phase_exit(entered);
+	}
+#else
+	explicit BasicPhase(PhaseSite) { }
+	~BasicPhase() { }
+#endif
+
+	BasicPhase(const BasicPhase&) = delete;
+	BasicPhase& operator=(const BasicPhase&) = delete;
+
+#ifndef SWP_DISABLE
+private:
+	// Site of the entered phase, exits only if the entry wasn't skipped.
+	struct swp_phase_site *entered = nullptr;
+#endif
+};
+
+using Phase = BasicPhase<Core::any>;
+
+}
+
+#define SWP_PHASE(var, name) ::swp::Phase var{SWP_PHASE_SITE(name)}
+
 #endif
 
 #endif
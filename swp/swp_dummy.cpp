@@ -24,5 +24,18 @@ extern "C" void swp_init() {
 extern "C" void swp_mark(const char *id, const char *pos) {
 }
 
+// Disable the site so that further calls cost only a branch.
+extern "C" void swp_mark_site(swp_site *site) {
+	site->enabled = 0;
+}
+
+// Entering disables the site, the matching exit still follows.
+extern "C" void swp_phase_enter(swp_phase_site *site, int hint) {
+	site->site.enabled = 0;
+}
+
+extern "C" void swp_phase_exit(swp_phase_site *site) {
+}
+
 extern "C" void swp_deinit() {
 }
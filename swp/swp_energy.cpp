@@ -0,0 +1,61 @@
+/*
+ * Copyright © 2018, Lukas Werling
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "swp_energy.h"
+
+namespace swp {
+
+bool EnergyCounter::open(int cpu) {
+	close();
+	struct rapl_msrs msrs;
+	if (rapl_msrs(&msrs) == 0 && rapl_msr_unit(cpu, &msrs, &unit) == 0) {
+		msr = true;
+		sources[package].available = rapl_open_msr(&sources[package].counter, cpu, msrs.package) == 0;
+		sources[core].available = rapl_open_msr(&sources[core].counter, cpu, msrs.core) == 0;
+		core_msr_per_core = msrs.core_per_core;
+	} else {
+		// Package domain and its "core" subdomain. Powercap doesn't expose
+		// per-core energy, so this is the energy of all cores.
+		char zone[64], sub[128];
+		msr = false;
+		unit = 1e-6;
+		core_msr_per_core = false;
+		if (rapl_powercap_zone(0, zone, sizeof zone) == 0) {
+			sources[package].available = rapl_open_powercap(&sources[package].counter, zone) == 0;
+			sources[core].available = rapl_powercap_core_zone(zone, sub, sizeof sub) == 0 &&
+					rapl_open_powercap(&sources[core].counter, sub) == 0;
+		}
+	}
+	return sources[package].available;
+}
+
+void EnergyCounter::close() {
+	for (auto& source : sources) {
+		if (source.available)
+			rapl_close(&source.counter);
+		source.available = false;
+	}
+}
+
+double EnergyCounter::joules(Domain domain) {
+	Source& source = sources[domain];
+	if (!source.available)
+		return 0;
+	rapl_sample(&source.counter);
+	return source.counter.total * unit;
+}
+
+}
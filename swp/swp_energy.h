@@ -0,0 +1,66 @@
+/*
+ * Copyright © 2018, Lukas Werling
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SWP_ENERGY_H
+#define SWP_ENERGY_H
+
+#include "../tools/rapl.h"
+
+namespace swp {
+
+// Cumulative RAPL energy counter of tools/rapl. Reads the MSRs (AMD family
+// 17h and Intel), falling back to powercap sysfs if the MSRs aren't
+// accessible.
+class EnergyCounter {
+public:
+	enum Domain { package, core, domain_max };
+
+	EnergyCounter() = default;
+	EnergyCounter(const EnergyCounter&) = delete;
+	EnergyCounter& operator=(const EnergyCounter&) = delete;
+	~EnergyCounter() { close(); }
+
+	// Opens the counters of the package and core of `cpu`. Returns false if
+	// neither MSRs nor powercap are available.
+	bool open(int cpu);
+
+	// Energy in joules since open(). The hardware counters wrap around after
+	// a few minutes at most, so this has to be called regularly.
+	double joules(Domain domain);
+
+	bool available(Domain domain) const { return sources[domain].available; }
+	// Whether the domain counts only the core of `cpu`. Only AMD's core
+	// energy MSR does; Intel's PP0 and powercap count all cores.
+	bool per_core(Domain domain) const { return domain == core && core_msr_per_core; }
+	const char *backend() const { return msr ? "msr" : "powercap"; }
+
+private:
+	struct Source {
+		bool available = false;
+		struct rapl_counter counter;
+	};
+
+	void close();
+
+	bool msr = false;
+	double unit = 0; // joules per count
+	bool core_msr_per_core = false;
+	Source sources[domain_max];
+};
+
+}
+
+#endif
@@ -18,75 +18,954 @@
 
 #include "swp.h"
 #include "swp_util.h"
+#include "swp_energy.h"
+#include "swp_perf.h"
+#include "swp_power.h"
+#include "swp_tune.h"
 #include "../ultmigration.h"
+#include "../topo/cputopo.h"
 
+#include <cpuid.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <float.h>
+#include <fnmatch.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <x86intrin.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
-static bool externally_registered;
-static double miss_rate_threshold;
+// Written by the tuner while other threads mark.
+static std::atomic<double> miss_rate_threshold;
+static double speedup_threshold;
+// Minimum average section length in TSC cycles.
+static uint64_t min_section_cycles;
+
+// With $SWP_POWER_MODEL, sections with a measured speedup run on the class
+// minimizing energy × delay^$SWP_EDP_EXP.
+static swp::PowerModel power_model;
+static bool have_power_model;
+static double delay_exp;
+static double tsc_hz;
+
+// Per-thread state. Registered threads are ULTs and keep their TLS on every
+// core, so this follows the application thread.
+struct ThreadState {
+	// Started through the pthread_create() wrapper below.
+	bool created = false;
+	// Checked whether the thread should migrate, see attach_thread().
+	bool checked = false;
+	// Marks of inactive threads are ignored.
+	bool active = false;
+	// Registered by libswp_migrate rather than by the application.
+	bool registered = false;
+	ult_thread_type current_type = ULT_FAST;
+	// Site of the running section (null for marks without site), its mark
+	// and its start.
+	struct Site *section_site = nullptr;
+	struct Mark *section_mark = nullptr;
+	uint64_t section_start = 0;
+	// Statistics of marks without site that aren't yet added to the marks,
+	// see learn_section().
+	std::unordered_map<struct Mark*, std::pair<uint64_t, double>> learned;
+	uint64_t learned_calls = 0;
+	// Core class that was active when entering each of the nested phases.
+	std::vector<ult_thread_type> phase_stack;
+};
+static thread_local ThreadState thread_state;
+
+// Set once swp_init() has read the configuration.
+static std::atomic<bool> initialized;
+// Protects the shared state below against concurrent threads. The fast path of
+// marks with sites only needs it for new sites and for periodic evaluation.
+static std::mutex state_mutex;
+
+// With $SWP_THREAD_INCLUDE, threads created by the application are registered
+// on their first mark if their name matches one of the comma-separated
+// patterns in $SWP_THREAD_INCLUDE but none of those in $SWP_THREAD_EXCLUDE.
+static std::vector<std::string> thread_include, thread_exclude;
+
+// With SWP_THRESHOLD=auto, a bandit picks the miss rate threshold among
+// candidates derived from the profile, every $SWP_TUNE_MS milliseconds.
+static swp::Bandit *tuner;
+static std::vector<double> tune_thresholds;
+static size_t tune_arm;
+static swp::EnergyCounter energy;
+static double tune_epoch; // seconds
+static std::atomic<uint64_t> tune_marks;
+static double tune_joules;
+static struct timespec tune_start;
 
 struct Mark {
 	double miss_rate = 0;
+	// Measured fast/slow speedup, 0 if the profile doesn't contain one.
+	double speedup = 0;
+	// Learned at runtime and persisted in $SWP_PROFILE.
+	uint64_t calls = 0;
+	double cycles = 0; // sum of section lengths in TSC cycles
+	bool disabled = false;
 
 	ult_thread_type thread_type() const {
-		return miss_rate > miss_rate_threshold ? ULT_SLOW : ULT_FAST;
+		if (speedup > 0 && have_power_model) {
+			double length = calls ? cycles / calls : min_section_cycles;
+			return power_model.choose(speedup, length / tsc_hz, thread_state.current_type, delay_exp);
+		}
+		if (speedup > 0 && speedup_threshold > 0)
+			return speedup < speedup_threshold ? ULT_SLOW : ULT_FAST;
+		double threshold = miss_rate_threshold.load(std::memory_order_relaxed);
+		return threshold > 0 && miss_rate > threshold ? ULT_SLOW : ULT_FAST;
 	}
+
+	// Estimated TSC cycles saved by running the section on the fast core, used
+	// by libultmigration to arbitrate between threads.
+	double benefit() const;
 };
 
 static std::map<std::string, Mark> marks;
 
+double Mark::benefit() const {
+	double length = calls ? cycles / calls : min_section_cycles;
+	double gain, threshold = miss_rate_threshold.load(std::memory_order_relaxed);
+	if (speedup > 0 && (speedup_threshold > 0 || have_power_model))
+		gain = 1 - 1 / speedup;
+	else if (threshold > 0)
+		gain = 1 - miss_rate / threshold;
+	else
+		gain = 0;
+	return gain > 0 ? gain * length : 0;
+}
+
+// With $SWP_TIMER_MS, a sampler thread classifies each interval by the miss
+// rate of each thread that runs ULTs and signals it if the application
+// thread running there should migrate. This covers code without marks. It
+// samples every pool thread, or with backends without pool threads the
+// application threads registered through libswp_migrate.
+static const int max_timer_threads = 64;
+// Sampled threads and the class to migrate to for timer_handler(), free slots
+// have tid 0.
+static std::atomic<pid_t> timer_tids[max_timer_threads];
+static std::atomic<int> timer_type[max_timer_threads];
+// Active application threads, protected by state_mutex.
+static std::vector<pid_t> active_tids;
+static std::atomic<bool> sampler_stop;
+static pthread_t sampler;
+static bool sampler_running;
+static int timer_signal;
+
+// Runtime statistics of a SWP_MARK call site. The section starting at the site
+// is unprofitable if it never changes the core class or if it is too short to
+// amortize a migration. Such sites get disabled and later re-enabled at random
+// to check again.
+struct Site {
+	swp_site *site;
+	Mark *mark;
+	// Counters for the current evaluation window, updated atomically by all
+	// threads.
+	uint64_t calls = 0, migrations = 0, cycles = 0;
+};
+
+// Number of calls after which the statistics of a site are added to its mark
+// and the site is evaluated. Marks without site are learned in the same
+// intervals per thread.
+static uint64_t site_window;
+// Whether evaluation disables unprofitable sites.
+static bool adapt_sites;
+// Number of marks between re-enabling a sample of the disabled sites.
+static uint64_t recheck_interval;
+
+static std::vector<Site*> disabled_sites;
+static size_t enabled_sites;
+static std::atomic<uint64_t> marks_since_recheck;
+
+// Learned statistics are saved to $SWP_PROFILE every $SWP_PROFILE_INTERVAL
+// seconds by a background thread, independent of how often the application
+// marks, and loaded again on startup.
+static const int profile_version = 2;
+static const char *profile_path;
+static double profile_interval;
+static std::string host;
+static pthread_t checkpointer;
+static bool checkpointer_running;
+static std::mutex checkpoint_mutex;
+static std::condition_variable checkpoint_cv;
+static bool checkpoint_stop;
+
+// Scoped phases by swp::phase_hash(). The marks are looked up once per phase
+// so that entering and leaving a phase doesn't need any string operations.
+struct Phase {
+	Mark *enter = nullptr, *exit = nullptr;
+	int hint = SWP_HINT_NONE;
+};
+
+static std::unordered_map<uint64_t, Phase> phases;
+
+static double seconds_since(const struct timespec& start, const struct timespec& now) {
+	return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// Ends a tuning epoch if it is long enough and switches to the next threshold.
+static void tune_check() {
+	std::lock_guard<std::mutex> lock(state_mutex);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	double seconds = seconds_since(tune_start, now);
+	if (seconds < tune_epoch)
+		return;
+	double joules = energy.joules(swp::EnergyCounter::package);
+	tuner->update(tune_arm, joules - tune_joules, tune_marks, seconds);
+	tune_arm = tuner->select();
+	miss_rate_threshold.store(tune_thresholds[tune_arm], std::memory_order_relaxed);
+	tune_marks = 0;
+	tune_joules = joules;
+	tune_start = now;
+}
+
+// Adds the statistics this thread collected for marks without site to the
+// marks.
+static void flush_learned() {
+	ThreadState& ts = thread_state;
+	if (ts.learned.empty())
+		return;
+	std::lock_guard<std::mutex> lock(state_mutex);
+	for (const auto& kv : ts.learned) {
+		kv.first->calls += kv.second.first;
+		kv.first->cycles += kv.second.second;
+	}
+	ts.learned.clear();
+	ts.learned_calls = 0;
+}
+
+static bool thread_matches(const char *name, const std::vector<std::string>& patterns) {
+	for (const auto& pattern : patterns)
+		if (fnmatch(pattern.c_str(), name, 0) == 0)
+			return true;
+	return false;
+}
+
+// Decides on the first mark of a thread whether its marks take effect. Threads
+// created by the application register here rather than at their start so that
+// their names are already set.
+static void attach_thread() {
+	ThreadState& ts = thread_state;
+	if (!initialized.load(std::memory_order_acquire))
+		return;
+	ts.checked = true;
+	ts.active = ult_registered();
+	if (!ts.active && ts.created) {
+		char name[16] = "";
+		pthread_getname_np(pthread_self(), name, sizeof name);
+		if (thread_matches(name, thread_include) && !thread_matches(name, thread_exclude)) {
+			ult_register_klt();
+			ts.active = ts.registered = true;
+		}
+	}
+	if (ts.active) {
+		std::lock_guard<std::mutex> lock(state_mutex);
+		active_tids.push_back(syscall(SYS_gettid));
+	}
+}
+
+// Unregisters the thread if libswp_migrate registered it.
+static void detach_thread() {
+	ThreadState& ts = thread_state;
+	flush_learned();
+	if (ts.active) {
+		std::lock_guard<std::mutex> lock(state_mutex);
+		auto it = std::find(active_tids.begin(), active_tids.end(), syscall(SYS_gettid));
+		if (it != active_tids.end())
+			active_tids.erase(it);
+	}
+	if (ts.registered)
+		ult_unregister_klt();
+	ts.registered = ts.active = false;
+}
+
+// Ends the running section and starts the one of `mark` on the given core,
+// unless libultmigration decides that other threads benefit more from it.
+// Marks with a site learn through the site's counters, the others through
+// the thread's.
+static void enter_section(Site *site, Mark *mark, ult_thread_type type, double benefit = 0) {
+	ThreadState& ts = thread_state;
+	if (__builtin_expect(!ts.checked, 0))
+		attach_thread();
+	if (!ts.active)
+		return;
+	if (tuner && (++tune_marks & 255) == 0)
+		tune_check();
+	uint64_t now = __rdtsc();
+	if (ts.section_site)
+		__atomic_fetch_add(&ts.section_site->cycles, now - ts.section_start, __ATOMIC_RELAXED);
+	else if (ts.section_mark)
+		ts.learned[ts.section_mark].second += now - ts.section_start;
+	ts.section_site = site;
+	ts.section_mark = site ? nullptr : mark;
+	ts.section_start = now;
+	if (ts.section_mark) {
+		ts.learned[mark].first++;
+		if (++ts.learned_calls >= site_window)
+			flush_learned();
+	}
+	ult_thread_type previous = ts.current_type;
+	ts.current_type = ult_migrate_benefit(type, benefit);
+	if (site) {
+		__atomic_fetch_add(&site->calls, 1, __ATOMIC_RELAXED);
+		if (ts.current_type != previous)
+			__atomic_fetch_add(&site->migrations, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void disable_site(Site *site) {
+	// Keep at least one site enabled so that recheck_sites() still runs.
+	if (enabled_sites <= 1)
+		return;
+	__atomic_store_n(&site->site->enabled, 0, __ATOMIC_RELAXED);
+	site->mark->disabled = true;
+	enabled_sites--;
+	disabled_sites.push_back(site);
+}
+
+static void evaluate_site(Site *site) {
+	std::lock_guard<std::mutex> lock(state_mutex);
+	// Another thread may have evaluated the site in the meantime.
+	if (site->calls < site_window)
+		return;
+	site->mark->calls += site->calls;
+	site->mark->cycles += site->cycles;
+	if (adapt_sites && (site->migrations == 0 || site->cycles / site->calls < min_section_cycles))
+		disable_site(site);
+	site->calls = site->migrations = site->cycles = 0;
+}
+
+static void recheck_sites() {
+	size_t n = (disabled_sites.size() + 3) / 4;
+	while (n--) {
+		size_t i = rand() % disabled_sites.size();
+		Site *site = disabled_sites[i];
+		disabled_sites[i] = disabled_sites.back();
+		disabled_sites.pop_back();
+		site->mark->disabled = false;
+		__atomic_store_n(&site->site->enabled, 1, __ATOMIC_RELAXED);
+		enabled_sites++;
+	}
+}
+
+// Identifies CPU model, CPU count and core configuration so that profiles
+// learned on a different host are rejected.
+static std::string host_tag() {
+	unsigned eax = 0, ebx = 0, ecx = 0, edx = 0;
+	char vendor[13] = {0};
+	__get_cpuid(0, &eax, &ebx, &ecx, &edx);
+	memcpy(vendor, &ebx, 4);
+	memcpy(vendor + 4, &edx, 4);
+	memcpy(vendor + 8, &ecx, 4);
+	__get_cpuid(1, &eax, &ebx, &ecx, &edx);
+	unsigned family = (eax >> 8) & 0xf, model = (eax >> 4) & 0xf, stepping = eax & 0xf;
+	if (family == 0xf)
+		family += (eax >> 20) & 0xff;
+	if (family >= 6)
+		model |= ((eax >> 16) & 0xf) << 4;
+	const char *fast = cputopo_class_cpus(0), *slow = cputopo_class_cpus(1);
+	char tag[256];
+	snprintf(tag, sizeof tag, "%s-%x-%x-%x/%ld/%s/%s", vendor, family, model, stepping,
+			sysconf(_SC_NPROCESSORS_CONF), fast ? fast : "-", slow ? slow : "-");
+	return tag;
+}
+
+static bool load_profile() {
+	FILE *f = fopen(profile_path, "r");
+	if (f == nullptr)
+		return false;
+	int version;
+	char tag[256];
+	if (fscanf(f, "swp-profile %d %255s\n", &version, tag) != 2 || version != profile_version || host != tag) {
+		fprintf(stderr, "swp: ignoring profile %s from a different version or host\n", profile_path);
+		fclose(f);
+		return false;
+	}
+	char node[256]; double miss_rate, speedup, cycles; uint64_t calls; int disabled;
+	while (fscanf(f, "\"%255[^\"]\" %lf %lf %" SCNu64 " %lf %d\n", node, &miss_rate, &speedup, &calls, &cycles, &disabled) == 6) {
+		auto& mark = marks[node];
+		mark.miss_rate = miss_rate;
+		mark.speedup = speedup;
+		mark.calls = calls;
+		mark.cycles = cycles;
+		mark.disabled = disabled;
+	}
+	fclose(f);
+	return true;
+}
+
+// Writes the profile to a temporary file first so that readers never see a
+// partially written profile.
+static void save_profile() {
+	std::string tmp = std::string(profile_path) + ".tmp";
+	FILE *f = fopen(tmp.c_str(), "w");
+	if (f == nullptr) {
+		perror("swp: couldn't write profile");
+		return;
+	}
+	fprintf(f, "swp-profile %d %s\n", profile_version, host.c_str());
+	for (const auto& kv : marks) {
+		const auto& mark = kv.second;
+		fprintf(f, "\"%s\" %.17g %.17g %" PRIu64 " %.17g %d\n",
+				kv.first.c_str(), mark.miss_rate, mark.speedup, mark.calls, mark.cycles, mark.disabled);
+	}
+	bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+	ok = fclose(f) == 0 && ok;
+	if (!ok || rename(tmp.c_str(), profile_path) < 0)
+		perror("swp: couldn't write profile");
+}
+
+// CPUs of both core classes, which housekeeping threads avoid.
+static std::vector<int> pool_cpus() {
+	std::vector<int> cpus = swp::class_cpus(false), slow = swp::class_cpus(true);
+	cpus.insert(cpus.end(), slow.begin(), slow.end());
+	return cpus;
+}
+
+static void *checkpoint_main(void *) {
+	std::unique_lock<std::mutex> lock(checkpoint_mutex);
+	auto interval = std::chrono::duration<double>(profile_interval);
+	while (!checkpoint_cv.wait_for(lock, interval, [] { return checkpoint_stop; })) {
+		std::lock_guard<std::mutex> state_lock(state_mutex);
+		save_profile();
+	}
+	return nullptr;
+}
+
+static void start_checkpointer() {
+	checkpointer = swp::start_housekeeping_thread(checkpoint_main, pool_cpus());
+	checkpointer_running = true;
+}
+
+static void stop_checkpointer() {
+	{
+		std::lock_guard<std::mutex> lock(checkpoint_mutex);
+		checkpoint_stop = true;
+	}
+	checkpoint_cv.notify_one();
+	pthread_join(checkpointer, nullptr);
+}
+
+static void housekeeping() {
+	// Skip if another thread is already at it.
+	std::unique_lock<std::mutex> lock(state_mutex, std::try_to_lock);
+	if (!lock.owns_lock())
+		return;
+	marks_since_recheck = 0;
+	if (adapt_sites)
+		recheck_sites();
+}
+
+static Mark *find_mark(const std::string& name) {
+	auto it = marks.find(name);
+	return it != marks.end() ? &it->second : nullptr;
+}
+
+// Elements of `phases` keep their address, so call sites cache pointers to
+// them in their state.
+static const Phase& lookup_phase(swp_phase_site *s, int hint) {
+	auto phase = static_cast<const Phase*>(__atomic_load_n(&s->site.state, __ATOMIC_ACQUIRE));
+	if (phase)
+		return *phase;
+	std::lock_guard<std::mutex> lock(state_mutex);
+	auto it = phases.find(s->hash);
+	if (it == phases.end()) {
+		it = phases.emplace(s->hash, Phase()).first;
+		it->second.enter = find_mark(swp::section_name(s->site.id, nullptr));
+		it->second.exit = find_mark(swp::section_name(s->site.id, "exit"));
+		it->second.hint = hint;
+	}
+	__atomic_store_n(&s->site.state, &it->second, __ATOMIC_RELEASE);
+	return it->second;
+}
+
+// Candidate thresholds for tuning: everything on the fast core, and thresholds
+// between the distinct miss rates of the profile, thinned out to `max` arms.
+static std::vector<double> threshold_candidates(size_t max) {
+	std::vector<double> rates;
+	for (const auto& kv : marks)
+		if (kv.second.miss_rate > 0)
+			rates.push_back(kv.second.miss_rate);
+	std::sort(rates.begin(), rates.end());
+	rates.erase(std::unique(rates.begin(), rates.end()), rates.end());
+	std::vector<double> candidates{DBL_MAX};
+	size_t steps = std::min(rates.size(), max > 1 ? max - 1 : 0);
+	for (size_t k = 0; k < steps; k++) {
+		size_t i = k * rates.size() / steps;
+		candidates.push_back(i ? (rates[i - 1] + rates[i]) / 2 : rates[0] / 2);
+	}
+	return candidates;
+}
+
+static void start_tuner() {
+	int fast = swp::class_cpu(false);
+	if (!energy.open(fast >= 0 ? fast : 0)) {
+		fprintf(stderr, "swp: SWP_THRESHOLD=auto needs RAPL via /dev/cpu/*/msr or powercap\n");
+		exit(-1);
+	}
+	tune_thresholds = threshold_candidates(swp::env_ulong("SWP_TUNE_ARMS", 8));
+	tuner = new swp::Bandit(tune_thresholds.size(),
+			swp::env_double("SWP_TUNE_DISCOUNT", 0.95),
+			swp::env_double("SWP_TUNE_EXPLORE", 0.1),
+			swp::env_double("SWP_TUNE_FLOOR", 0.9));
+	tune_epoch = swp::env_double("SWP_TUNE_MS", 100) / 1000;
+	// Disabled sites don't count as marks, so site adaptation would distort
+	// the throughput. Sites still learn the lengths of their sections.
+	adapt_sites = false;
+	tune_arm = tuner->select();
+	miss_rate_threshold.store(tune_thresholds[tune_arm], std::memory_order_relaxed);
+	tune_joules = energy.joules(swp::EnergyCounter::package);
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &tune_start);
+	printf("swp: tuning between %zu thresholds using %s energy counters\n",
+			tune_thresholds.size(), energy.backend());
+}
+
+// Measures the TSC frequency for converting section lengths to seconds.
+static double measure_tsc_hz() {
+	struct timespec start, end, delay = {0, 10000000};
+	clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+	uint64_t tsc_start = __rdtsc();
+	nanosleep(&delay, nullptr);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+	uint64_t tsc_end = __rdtsc();
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	return (tsc_end - tsc_start) / seconds;
+}
+
+// Runs on the application's ULT. Installed with SA_NODEFER, see
+// ult_migrate_from_signal(). An idle pool thread still has the fs base of
+// the last ULT, whose TLS may be gone, so this finds the sampled thread by
+// its tid and touches thread_local state only after ult_migrate_from_signal()
+// confirmed that a ULT runs here. Backends without pool threads run on the
+// application thread's own TLS, and only their system calls may set errno.
+static void timer_handler(int) {
+	pid_t tid = syscall(SYS_gettid);
+	for (int i = 0; i < max_timer_threads; i++) {
+		if (timer_tids[i].load(std::memory_order_relaxed) != tid)
+			continue;
+		bool own_tls = !(ult_backend_caps() & ULT_CAP_POOL);
+		int saved_errno = own_tls ? errno : 0;
+		ult_thread_type type = static_cast<ult_thread_type>(timer_type[i].load(std::memory_order_relaxed));
+		if (ult_migrate_from_signal(type))
+			thread_state.current_type = type;
+		if (own_tls)
+			errno = saved_errno;
+		return;
+	}
+}
+
+// State of a thread watched by the sampler.
+struct SampledThread {
+	swp::PerfCounters counters;
+	// Class the thread runs on. For application threads, this is the class
+	// the sampler last asked for, as marks may move them in between.
+	ult_thread_type type = ULT_FAST;
+	// Number of consecutive intervals that asked for the other class.
+	unsigned agreed = 0;
+	int slot = -1;
+	bool seen = false;
+};
+
+// Lists the threads to sample and the class they run on, ULT_TYPE_MAX for
+// application threads.
+static std::vector<std::pair<pid_t, ult_thread_type>> sampled_threads() {
+	std::vector<std::pair<pid_t, ult_thread_type>> threads;
+	if (ult_backend_caps() & ULT_CAP_POOL) {
+		pid_t tids[max_timer_threads];
+		for (int t = 0; t < ULT_TYPE_MAX; t++) {
+			auto type = static_cast<ult_thread_type>(t);
+			int n = std::min(ult_pool_threads(type, tids, max_timer_threads), max_timer_threads);
+			for (int i = 0; i < n; i++)
+				threads.emplace_back(tids[i], type);
+		}
+	} else {
+		std::lock_guard<std::mutex> lock(state_mutex);
+		for (pid_t tid : active_tids)
+			threads.emplace_back(tid, ULT_TYPE_MAX);
+	}
+	return threads;
+}
+
+// Follows pool threads started by a reconfiguration and application threads
+// that started or exited since the last interval.
+static void update_sampled(std::map<pid_t, SampledThread>& sampled) {
+	for (auto& kv : sampled)
+		kv.second.seen = false;
+	for (const auto& thread : sampled_threads()) {
+		auto it = sampled.find(thread.first);
+		if (it == sampled.end()) {
+			int slot = 0;
+			while (slot < max_timer_threads && timer_tids[slot].load(std::memory_order_relaxed) != 0)
+				slot++;
+			if (slot == max_timer_threads)
+				continue;
+			it = sampled.emplace(std::piecewise_construct, std::forward_as_tuple(thread.first), std::forward_as_tuple()).first;
+			if (!it->second.counters.open(thread.first)) {
+				// The thread may have exited in the meantime.
+				if (errno != ESRCH) {
+					perror("swp: couldn't open perf counters for $SWP_TIMER_MS");
+					exit(-1);
+				}
+				sampled.erase(it);
+				continue;
+			}
+			it->second.slot = slot;
+			timer_tids[slot].store(thread.first, std::memory_order_relaxed);
+		}
+		if (thread.second != ULT_TYPE_MAX)
+			it->second.type = thread.second;
+		it->second.seen = true;
+	}
+	for (auto it = sampled.begin(); it != sampled.end();) {
+		if (it->second.seen) {
+			++it;
+			continue;
+		}
+		timer_tids[it->second.slot].store(0, std::memory_order_relaxed);
+		it = sampled.erase(it);
+	}
+}
+
+static void *sampler_main(void *) {
+	struct timespec interval;
+	double ms = swp::env_double("SWP_TIMER_MS", 10);
+	interval.tv_sec = ms / 1000;
+	interval.tv_nsec = (ms - interval.tv_sec * 1000) * 1e6;
+	// Number of consecutive intervals that have to agree before migrating.
+	unsigned confirm = swp::env_ulong("SWP_TIMER_CONFIRM", 2);
+	uint64_t min_instructions = swp::env_ulong("SWP_TIMER_MIN_INSTR", 100000);
+	bool pool = ult_backend_caps() & ULT_CAP_POOL;
+
+	std::map<pid_t, SampledThread> sampled;
+	update_sampled(sampled);
+	while (!sampler_stop.load(std::memory_order_relaxed)) {
+		nanosleep(&interval, nullptr);
+		update_sampled(sampled);
+		// Each sampled thread runs a different application thread, so
+		// classify them separately.
+		for (auto& kv : sampled) {
+			SampledThread& thread = kv.second;
+			uint64_t instructions, misses;
+			if (!thread.counters.read(&instructions, &misses) || instructions < min_instructions) {
+				thread.agreed = 0;
+				continue;
+			}
+			double miss_rate = static_cast<double>(misses) / instructions;
+			ult_thread_type type = miss_rate > miss_rate_threshold.load(std::memory_order_relaxed) ? ULT_SLOW : ULT_FAST;
+			if (type == thread.type || ++thread.agreed < confirm) {
+				if (type == thread.type)
+					thread.agreed = 0;
+				continue;
+			}
+			thread.agreed = 0;
+			timer_type[thread.slot].store(type, std::memory_order_relaxed);
+			syscall(SYS_tgkill, getpid(), kv.first, timer_signal);
+			// Pool threads keep their class, the ULT moves to another one.
+			if (!pool)
+				thread.type = type;
+		}
+	}
+	for (auto& tid : timer_tids)
+		tid.store(0, std::memory_order_relaxed);
+	return nullptr;
+}
+
+static void start_sampler() {
+	if (miss_rate_threshold <= 0) {
+		fprintf(stderr, "swp: $SWP_TIMER_MS needs $SWP_THRESHOLD\n");
+		exit(-1);
+	}
+
+	timer_signal = SIGRTMIN + swp::env_ulong("SWP_TIMER_SIGNAL", 4);
+	struct sigaction action;
+	memset(&action, 0, sizeof action);
+	action.sa_handler = timer_handler;
+	action.sa_flags = SA_NODEFER | SA_RESTART;
+	sigaction(timer_signal, &action, nullptr);
+
+	sampler = swp::start_housekeeping_thread(sampler_main, pool_cpus());
+	sampler_running = true;
+}
+
+static void stop_sampler() {
+	sampler_stop.store(true, std::memory_order_relaxed);
+	pthread_join(sampler, nullptr);
+	signal(timer_signal, SIG_IGN);
+}
+
 static void print_marks() {
-	printf("Mark / miss rate:\n");
+	printf("Mark / miss rate / speedup:\n");
 	for (const auto& kv : marks) {
-		printf("\t%s: %f (%s)\n",
-				kv.first.c_str(), kv.second.miss_rate,
+		printf("\t%s: %f / %f (%s)\n",
+				kv.first.c_str(), kv.second.miss_rate, kv.second.speedup,
 				kv.second.thread_type() == ULT_SLOW ? "slow" : "fast");
 	}
 }
 
+// Splits a comma-separated list of patterns from the environment.
+static std::vector<std::string> env_patterns(const char *var) {
+	std::vector<std::string> patterns;
+	const char *list = getenv(var);
+	while (list && *list) {
+		const char *end = strchrnul(list, ',');
+		if (end != list)
+			patterns.emplace_back(list, end);
+		list = *end ? end + 1 : end;
+	}
+	return patterns;
+}
+
 extern "C" void swp_init() {
-	// Read marks from the configuration file.
-	FILE *f = fopen(getenv("SWP_CFG"), "r");
-	if (f == nullptr) {
-		fprintf(stderr, "SWP_CFG=%s\n", getenv("SWP_CFG"));
-		perror("couldn't open $SWP_CFG");
+	host = host_tag();
+	profile_path = getenv("SWP_PROFILE");
+	if (profile_path && !*profile_path)
+		profile_path = nullptr;
+	profile_interval = swp::env_double("SWP_PROFILE_INTERVAL", 60);
+	bool have_profile = profile_path && load_profile();
+
+	// Read marks from the configuration file. Its values take precedence over
+	// the saved profile. The speedup column is optional.
+	const char *cfg = getenv("SWP_CFG");
+	FILE *f = cfg ? fopen(cfg, "r") : nullptr;
+	if (f == nullptr && !have_profile) {
+		if (cfg) {
+			fprintf(stderr, "SWP_CFG=%s\n", cfg);
+			perror("couldn't open $SWP_CFG");
+		} else {
+			fprintf(stderr, "$SWP_CFG not set and no usable $SWP_PROFILE\n");
+		}
 		exit(-1);
 	}
-	char node[100]; double misses;
-	while (fscanf(f, "\"%100[^\"]\" %lf\n", node, &misses) != EOF) {
-		marks[node].miss_rate = misses;
+	if (f != nullptr) {
+		char line[512], node[256]; double misses, speedup;
+		while (fgets(line, sizeof line, f)) {
+			int n = sscanf(line, "\"%255[^\"]\" %lf %lf", node, &misses, &speedup);
+			if (n < 2)
+				break;
+			marks[node].miss_rate = misses;
+			if (n == 3)
+				marks[node].speedup = speedup;
+		}
+		fclose(f);
 	}
-	fclose(f);
 
+	// Marks with a measured speedup use $SWP_SPEEDUP_THRESHOLD, all others
+	// the miss rate threshold.
+	speedup_threshold = swp::env_double("SWP_SPEEDUP_THRESHOLD", 0);
+	const char *model = getenv("SWP_POWER_MODEL");
+	if (model && *model) {
+		if (!power_model.load(model))
+			exit(-1);
+		have_power_model = true;
+		delay_exp = swp::env_double("SWP_EDP_EXP", 1);
+		tsc_hz = measure_tsc_hz();
+	}
 	char *threshold_env = getenv("SWP_THRESHOLD");
-	if (threshold_env)
-		miss_rate_threshold = strtod(threshold_env, nullptr);
-	if (!threshold_env || miss_rate_threshold == 0) {
+	bool auto_threshold = threshold_env && !strcmp(threshold_env, "auto");
+	if (threshold_env && !auto_threshold)
+		miss_rate_threshold.store(strtod(threshold_env, nullptr));
+	if ((!threshold_env || miss_rate_threshold == 0) && !auto_threshold && speedup_threshold == 0 && !have_power_model) {
 		fprintf(stderr, "$SWP_THRESHOLD not set\n");
 		exit(-1);
 	}
 
+	// SWP_SITE_WINDOW=0 only disables the adaptation, marks keep learning.
+	site_window = swp::env_ulong("SWP_SITE_WINDOW", 1024);
+	adapt_sites = site_window > 0;
+	if (!adapt_sites)
+		site_window = 1024;
+	min_section_cycles = swp::env_ulong("SWP_MIN_CYCLES", 10000);
+	recheck_interval = swp::env_ulong("SWP_RECHECK_INTERVAL", 1 << 16);
+	if (auto_threshold)
+		start_tuner();
+
 	print_marks();
 
-	if (ult_registered())
-		externally_registered = true;
-	else {
+	thread_include = env_patterns("SWP_THREAD_INCLUDE");
+	thread_exclude = env_patterns("SWP_THREAD_EXCLUDE");
+
+	// Keep the pool threads running so that application threads register
+	// without starting them again.
+	ult_init();
+	// The initializing thread always migrates.
+	ThreadState& ts = thread_state;
+	ts.checked = ts.active = true;
+	if (!ult_registered()) {
 		ult_register_klt();
-		externally_registered = false;
+		ts.registered = true;
 	}
+	{
+		std::lock_guard<std::mutex> lock(state_mutex);
+		active_tids.push_back(syscall(SYS_gettid));
+	}
+	initialized.store(true, std::memory_order_release);
+	if (getenv("SWP_TIMER_MS"))
+		start_sampler();
+	if (profile_path && profile_interval > 0)
+		start_checkpointer();
 	swp_mark("swp_init", nullptr);
 }
 
 extern "C" void swp_mark(const char *id, const char *pos) {
 	std::string name = swp::section_name(id, pos);
-	const auto& mark = marks[name];
-	ult_migrate(mark.thread_type());
+	Mark *mark;
+	{
+		std::lock_guard<std::mutex> lock(state_mutex);
+		mark = &marks[name];
+	}
+	enter_section(nullptr, mark, mark->thread_type(), mark->benefit());
+}
+
+extern "C" void swp_mark_site(swp_site *s) {
+	Site *site = static_cast<Site*>(__atomic_load_n(&s->state, __ATOMIC_ACQUIRE));
+	if (!site) {
+		std::lock_guard<std::mutex> lock(state_mutex);
+		site = static_cast<Site*>(s->state);
+		if (!site) {
+			site = new Site;
+			site->site = s;
+			site->mark = &marks[swp::section_name(s->id, s->pos)];
+			enabled_sites++;
+			// Warm start from the saved profile.
+			if (adapt_sites && site->mark->disabled)
+				disable_site(site);
+			__atomic_store_n(&s->state, site, __ATOMIC_RELEASE);
+		}
+	}
+	enter_section(site, site->mark, site->mark->thread_type(), site->mark->benefit());
+	if (__atomic_load_n(&site->calls, __ATOMIC_RELAXED) >= site_window)
+		evaluate_site(site);
+	if (++marks_since_recheck >= recheck_interval)
+		housekeeping();
+}
+
+extern "C" void swp_phase_enter(swp_phase_site *site, int hint) {
+	const auto& phase = lookup_phase(site, hint);
+	ThreadState& ts = thread_state;
+	ts.phase_stack.push_back(ts.current_type);
+	// The profile takes precedence over the hint. Without either, stay on the
+	// enclosing phase's core.
+	if (phase.enter)
+		enter_section(nullptr, phase.enter, phase.enter->thread_type(), phase.enter->benefit());
+	else if (phase.hint != SWP_HINT_NONE)
+		enter_section(nullptr, nullptr, static_cast<ult_thread_type>(phase.hint));
+	else
+		enter_section(nullptr, nullptr, ts.current_type);
+}
+
+extern "C" void swp_phase_exit(swp_phase_site *site) {
+	const auto& phase = lookup_phase(site, SWP_HINT_NONE);
+	ThreadState& ts = thread_state;
+	ult_thread_type outer = ts.current_type;
+	if (!ts.phase_stack.empty()) {
+		outer = ts.phase_stack.back();
+		ts.phase_stack.pop_back();
+	}
+	if (phase.exit)
+		enter_section(nullptr, phase.exit, phase.exit->thread_type(), phase.exit->benefit());
+	else
+		enter_section(nullptr, nullptr, outer);
 }
 
 extern "C" void swp_deinit() {
-	if (!externally_registered)
-		ult_unregister_klt();
+	if (sampler_running)
+		stop_sampler();
+	if (tuner) {
+		printf("swp: threshold / energy / throughput:\n");
+		tuner->print(stdout, tune_thresholds);
+	}
+	if (adapt_sites)
+		printf("swp: %zu marks disabled at exit\n", disabled_sites.size());
+	if (checkpointer_running)
+		stop_checkpointer();
+	flush_learned();
+	if (profile_path)
+		save_profile();
+	detach_thread();
+	ult_deinit();
+}
+
+// Threads created by the application start through this wrapper so that
+// attach_thread() can register them. Without $SWP_THREAD_INCLUDE, threads are
+// left alone, as are the threads that libswp_migrate and libultmigration start
+// themselves (pool threads, monitors, MSR workers, samplers), which run
+// library code and must never register.
+
+struct ThreadStart {
+	void *(*fn)(void *);
+	void *arg;
+};
+
+static void *thread_start(void *p) {
+	ThreadStart start = *static_cast<ThreadStart*>(p);
+	delete static_cast<ThreadStart*>(p);
+	thread_state.created = true;
+	void *ret = start.fn(start.arg);
+	detach_thread();
+	return ret;
+}
+
+template <typename Fn>
+static Fn *next_symbol(const char *name) {
+	void *sym = dlsym(RTLD_NEXT, name);
+	if (sym == nullptr) {
+		fprintf(stderr, "swp: %s not found\n", name);
+		exit(-1);
+	}
+	return reinterpret_cast<Fn*>(sym);
+}
+
+static const void *object_base(const void *addr) {
+	Dl_info info;
+	return dladdr(addr, &info) ? info.dli_fbase : nullptr;
+}
+
+// Whether the return address belongs to libswp_migrate or libultmigration.
+static bool internal_caller(const void *caller) {
+	static const void *self = object_base(reinterpret_cast<const void*>(&swp_init));
+	static const void *ult = object_base(reinterpret_cast<const void*>(&ult_init));
+	const void *base = object_base(caller);
+	return base != nullptr && (base == self || base == ult);
+}
+
+extern "C" int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                              void *(*fn)(void *), void *arg) {
+	static auto real = next_symbol<decltype(pthread_create)>("pthread_create");
+	static bool wrap = getenv("SWP_THREAD_INCLUDE") != nullptr;
+	if (!wrap || internal_caller(__builtin_return_address(0)))
+		return real(thread, attr, fn, arg);
+	auto *start = new ThreadStart{fn, arg};
+	int ret = real(thread, attr, thread_start, start);
+	if (ret != 0)
+		delete start;
+	return ret;
+}
+
+// A registered thread has to return to its own kernel-level thread before it
+// exits, otherwise it would terminate the pool thread running it. Only threads
+// started through the wrapper above register themselves, the initializing
+// thread unregisters in swp_deinit().
+extern "C" void pthread_exit(void *ret) {
+	static auto real = next_symbol<decltype(pthread_exit)>("pthread_exit");
+	static bool wrap = getenv("SWP_THREAD_INCLUDE") != nullptr;
+	if (wrap && !internal_caller(__builtin_return_address(0)))
+		detach_thread();
+	real(ret);
+	__builtin_unreachable();
 }
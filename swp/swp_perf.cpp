@@ -0,0 +1,67 @@
+/*
+ * Copyright © 2018, Lukas Werling
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "swp_perf.h"
+
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace swp {
+
+static int perf_open(pid_t tid, uint64_t config, int group) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof attr);
+	attr.size = sizeof attr;
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.read_format = PERF_FORMAT_GROUP;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, tid, -1, group, 0);
+}
+
+PerfCounters::~PerfCounters() {
+	if (member >= 0)
+		close(member);
+	if (leader >= 0)
+		close(leader);
+}
+
+bool PerfCounters::open(pid_t tid) {
+	leader = perf_open(tid, PERF_COUNT_HW_INSTRUCTIONS, -1);
+	if (leader < 0)
+		return false;
+	member = perf_open(tid, PERF_COUNT_HW_CACHE_MISSES, leader);
+	if (member < 0)
+		return false;
+	uint64_t instructions, misses;
+	return read(&instructions, &misses);
+}
+
+bool PerfCounters::read(uint64_t *instructions, uint64_t *misses) {
+	struct { uint64_t nr, values[2]; } data;
+	if (::read(leader, &data, sizeof data) != sizeof data || data.nr != 2)
+		return false;
+	*instructions = data.values[0] - last[0];
+	*misses = data.values[1] - last[1];
+	last[0] = data.values[0];
+	last[1] = data.values[1];
+	return true;
+}
+
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright © 2018, Lukas Werling
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SWP_PERF_H
+#define SWP_PERF_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+namespace swp {
+
+// Counts retired instructions and last level cache misses of one thread using
+// perf_event_open(). Unlike likwid, this works without root for threads of the
+// own process.
+class PerfCounters {
+public:
+	~PerfCounters();
+
+	// Starts counting for `tid`. Returns false if perf is unavailable.
+	bool open(pid_t tid);
+
+	// Counts since the last call.
+	bool read(uint64_t *instructions, uint64_t *misses);
+
+private:
+	int leader = -1, member = -1;
+	uint64_t last[2] = {};
+};
+
+}
+
+#endif
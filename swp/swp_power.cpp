@@ -0,0 +1,81 @@
+/*
+ * Copyright © 2018, Lukas Werling
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "swp_power.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace swp {
+
+bool PowerModel::load(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (f == nullptr) {
+		perror("swp: couldn't open power model");
+		return false;
+	}
+	char line[256], key[32], kind[32]; double value;
+	int seen = 0;
+	while (fgets(line, sizeof line, f)) {
+		if (sscanf(line, "migration %lf", &value) == 1) {
+			migration_joules = value;
+			continue;
+		}
+		if (sscanf(line, "%31s %31s %lf", key, kind, &value) != 3)
+			continue;
+		int type = !strcmp(key, "fast") ? ULT_FAST : !strcmp(key, "slow") ? ULT_SLOW : -1;
+		if (type != -1 && !strcmp(kind, "compute"))
+			watts[type][compute] = value;
+		else if (type != -1 && !strcmp(kind, "memory"))
+			watts[type][memory] = value;
+		else if (!strcmp(key, "compute") && !strcmp(kind, "speedup"))
+			compute_speedup = value;
+		else
+			continue;
+		seen++;
+	}
+	fclose(f);
+	if (seen < 5 || compute_speedup <= 1) {
+		fprintf(stderr, "swp: incomplete power model %s\n", path);
+		return false;
+	}
+	return true;
+}
+
+ult_thread_type PowerModel::choose(double speedup, double seconds, ult_thread_type current, double delay_exp) const {
+	// Memory-bound code doesn't gain from the fast core, compute-bound code
+	// gains compute_speedup. Interpolate the power draw in between.
+	double m = (compute_speedup - speedup) / (compute_speedup - 1);
+	m = m < 0 ? 0 : m > 1 ? 1 : m;
+	double best_cost = INFINITY;
+	ult_thread_type best = current;
+	for (int t = 0; t < ULT_TYPE_MAX; t++) {
+		double power = (1 - m) * watts[t][compute] + m * watts[t][memory];
+		double delay = t == ULT_FAST ? seconds : seconds * speedup;
+		double energy = power * delay;
+		if (t != current)
+			energy += migration_joules;
+		double cost = energy * pow(delay, delay_exp);
+		if (cost < best_cost) {
+			best_cost = cost;
+			best = static_cast<ult_thread_type>(t);
+		}
+	}
+	return best;
+}
+
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright © 2018, Lukas Werling
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SWP_POWER_H
+#define SWP_POWER_H
+
+#include "../ultmigration.h"
+
+namespace swp {
+
+// Power model for choosing the core class that minimizes energy × delay^n.
+// Loaded from a text file (see benchmark/power_model.awk) with the lines
+//
+//     fast compute <W>
+//     fast memory <W>
+//     slow compute <W>
+//     slow memory <W>
+//     compute speedup <fast/slow speedup of compute-bound code>
+//     migration <J per migration>
+//
+// The power values exclude the idle power of the system.
+struct PowerModel {
+	enum Load { compute, memory, load_max };
+
+	double watts[ULT_TYPE_MAX][load_max] = {};
+	double compute_speedup = 0;
+	double migration_joules = 0;
+
+	// Returns false and prints a message if the file is invalid.
+	bool load(const char *path);
+
+	// Picks the class for a section that takes `seconds` on the fast core and
+	// runs `speedup` times faster there than on the slow core. Migrating away
+	// from `current` costs the migration energy.
+	ult_thread_type choose(double speedup, double seconds, ult_thread_type current, double delay_exp) const;
+};
+
+}
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ * Copyright © 2018, Lukas Werling
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "swp_tune.h"
+
+#include <math.h>
+
+namespace swp {
+
+Bandit::Bandit(size_t arms, double discount, double explore, double floor)
+	: arms(arms), discount(discount), explore(explore), floor(floor) {
+}
+
+void Bandit::update(size_t arm, double joules, double work, double seconds) {
+	for (auto& a : arms) {
+		a.epochs *= discount;
+		a.joules *= discount;
+		a.work *= discount;
+		a.seconds *= discount;
+	}
+	arms[arm].epochs += 1;
+	arms[arm].joules += joules;
+	arms[arm].work += work;
+	arms[arm].seconds += seconds;
+}
+
+// Energy efficiency relative to the reference arm, scaled down by the
+// throughput shortfall below the floor.
+double Bandit::score(const Arm& arm) const {
+	const Arm& ref = arms[0];
+	if (arm.work == 0 || arm.joules == 0 || ref.work == 0 || ref.seconds == 0)
+		return 0;
+	double efficiency = (ref.joules / ref.work) / (arm.joules / arm.work);
+	double throughput = (arm.work / arm.seconds) / (ref.work / ref.seconds);
+	if (throughput < floor)
+		efficiency *= throughput / floor * throughput / floor;
+	return efficiency;
+}
+
+size_t Bandit::select() const {
+	double total = 0;
+	for (const auto& a : arms) {
+		// Play every arm (and the reference first) once.
+		if (a.epochs == 0)
+			return &a - &arms[0];
+		total += a.epochs;
+	}
+	size_t best = 0;
+	double best_ucb = -INFINITY;
+	for (size_t i = 0; i < arms.size(); i++) {
+		double ucb = score(arms[i]) + explore * sqrt(2 * log(total) / arms[i].epochs);
+		if (ucb > best_ucb) {
+			best_ucb = ucb;
+			best = i;
+		}
+	}
+	return best;
+}
+
+size_t Bandit::best() const {
+	size_t best = 0;
+	for (size_t i = 1; i < arms.size(); i++)
+		if (score(arms[i]) > score(arms[best]))
+			best = i;
+	return best;
+}
+
+void Bandit::print(FILE *f, const std::vector<double>& labels) const {
+	for (size_t i = 0; i < arms.size(); i++) {
+		const Arm& a = arms[i];
+		fprintf(f, "\t%g: %.1f epochs, %g J/work, %g work/s, score %f%s\n",
+				labels[i], a.epochs, a.work ? a.joules / a.work : 0,
+				a.seconds ? a.work / a.seconds : 0, score(a), i == best() ? " (best)" : "");
+	}
+}
+
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright © 2018, Lukas Werling
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SWP_TUNE_H
+#define SWP_TUNE_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <vector>
+
+namespace swp {
+
+// Discounted UCB bandit for choosing a configuration online. Each arm is
+// rewarded by its energy per unit of work, relative to arm 0 as reference.
+// Arms that fall below `floor` times the throughput of arm 0 only get a
+// fraction of that reward. Discounting old epochs lets the choice follow
+// changes in the load.
+class Bandit {
+public:
+	Bandit(size_t arms, double discount, double explore, double floor);
+
+	// Records one epoch of `arm` that did `work` in `seconds` using `joules`.
+	void update(size_t arm, double joules, double work, double seconds);
+
+	// Picks the arm for the next epoch.
+	size_t select() const;
+
+	// Current best arm without exploration.
+	size_t best() const;
+
+	void print(FILE *f, const std::vector<double>& labels) const;
+
+private:
+	struct Arm {
+		// Discounted sums
+		double epochs = 0, joules = 0, work = 0, seconds = 0;
+	};
+
+	double score(const Arm& arm) const;
+
+	std::vector<Arm> arms;
+	double discount, explore, floor;
+};
+
+}
+
+#endif
@@ -15,6 +15,12 @@
  */
 
 #include "swp_util.h"
+#include "../topo/cputopo.h"
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 namespace swp {
 
@@ -22,4 +28,59 @@ std::string section_name(const char *id, const char *pos) {
 	return pos ? std::move(std::string(id) + " [" + pos + "]") : id;
 }
 
+unsigned long env_ulong(const char *name, unsigned long def) {
+	const char *value = getenv(name);
+	return value && *value ? strtoul(value, nullptr, 0) : def;
+}
+
+double env_double(const char *name, double def) {
+	const char *value = getenv(name);
+	return value && *value ? strtod(value, nullptr) : def;
+}
+
+int class_cpu(bool slow) {
+	const char *list = cputopo_class_cpus(slow);
+	return list ? atoi(list) : -1;
+}
+
+std::vector<int> class_cpus(bool slow) {
+	std::vector<int> cpus;
+	const char *list = cputopo_class_cpus(slow);
+	while (list && *list) {
+		char *end;
+		long cpu = strtol(list, &end, 10);
+		if (end == list)
+			break;
+		cpus.push_back(cpu);
+		list = *end == ',' ? end + 1 : end;
+	}
+	return cpus;
+}
+
+pthread_t start_housekeeping_thread(void *(*fn)(void *), const std::vector<int>& exclude_cpus) {
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	const char *housekeeping = getenv("SWP_HOUSEKEEPING_CPU");
+	if (housekeeping && *housekeeping) {
+		CPU_SET(atoi(housekeeping), &cpus);
+	} else {
+		for (int cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN); cpu++)
+			CPU_SET(cpu, &cpus);
+		for (int cpu : exclude_cpus)
+			CPU_CLR(cpu, &cpus);
+	}
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	if (CPU_COUNT(&cpus) > 0)
+		pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+	pthread_t thread;
+	int err = pthread_create(&thread, &attr, fn, nullptr);
+	pthread_attr_destroy(&attr);
+	if (err) {
+		fprintf(stderr, "swp: Failed to start background thread\n");
+		exit(-1);
+	}
+	return thread;
+}
+
 }
@@ -17,12 +17,29 @@
 #ifndef SWP_UTIL_H
 #define SWP_UTIL_H
 
+#include <pthread.h>
+
 #include <string>
+#include <vector>
 
 namespace swp {
 
 std::string section_name(const char *id, const char *pos);
 
+// Reads a numeric environment variable, returning `def` if it is unset.
+unsigned long env_ulong(const char *name, unsigned long def);
+double env_double(const char *name, double def);
+
+// Returns the first CPU of the fast (slow = false) or slow core class, from
+// $FAST_CPU/$SLOW_CPU or the CPU topology (see topo/cputopo.h), or -1.
+int class_cpu(bool slow);
+// Returns all CPUs of the core class, empty if there are none.
+std::vector<int> class_cpus(bool slow);
+
+// Starts a background thread on $SWP_HOUSEKEEPING_CPU, or on any CPU but the
+// given ones. Exits on failure.
+pthread_t start_housekeeping_thread(void *(*fn)(void *), const std::vector<int>& exclude_cpus);
+
 }
 
 #endif
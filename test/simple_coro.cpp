@@ -0,0 +1,39 @@
+/*
+ * Copyright © 2018, Lukas Werling
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// Simple test for ultmigration_coro.h that switches core classes from a few
+// coroutines.
+
+#include <sched.h>
+#include <cstdio>
+#include "ultmigration_coro.h"
+
+int main() {
+	ult::executor ex;
+	for (int c = 0; c < 4; c++) {
+		// The coroutine starts later, so take c as a parameter, which is
+		// copied into the coroutine frame.
+		ex.start([](int c) -> ult::task {
+			for (int i = 0; i < 10; i++) {
+				int cpu = sched_getcpu();
+				auto type = static_cast<enum ult_thread_type>(i % ULT_TYPE_MAX);
+				co_await ult::on(type);
+				printf("coroutine %d: on(%d): CPU %d -> %d\n", c, type, cpu, sched_getcpu());
+			}
+		}(c));
+	}
+	ex.wait();
+}
@@ -18,10 +18,13 @@
 
 #define _GNU_SOURCE
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <sched.h>
 #include <time.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include "ultmigration.h"
 
 #define ITERATIONS 10000000
@@ -53,19 +56,116 @@ static void bench_split() {
 	printf("fast->slow: %f s for %d migrations, %e s/iter\n", result[1], ITERATIONS/2, result[1]*2 / ITERATIONS);
 }
 
-int main(int argc, char **argv) {
+#define REGISTRATIONS 100000
+
+static double bench_register_loop(int iterations) {
+	struct timespec tstart, tend;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &tstart);
+	for (int i = 0; i < iterations; i++) {
+		ult_register_klt();
+		ult_unregister_klt();
+	}
+	clock_gettime(CLOCK_MONOTONIC_RAW, &tend);
+	return ((double) tend.tv_sec - tstart.tv_sec) + (double) (tend.tv_nsec - tstart.tv_nsec) / 1e9;
+}
+
+/* registration with persistent pool threads */
+static void bench_register() {
+	ult_init();
+	double result = bench_register_loop(REGISTRATIONS);
+	ult_deinit();
+	printf("%f s for %d registrations, %e s/iter\n", result, REGISTRATIONS, result / REGISTRATIONS);
+}
+
+/* registration without ult_init(), starting and stopping the pool threads
+ * every time */
+static void bench_register_lazy() {
+	double result = bench_register_loop(REGISTRATIONS / 100);
+	printf("%f s for %d registrations, %e s/iter\n", result, REGISTRATIONS / 100, result * 100 / REGISTRATIONS);
+}
+
+static void *register_thread(void *arg) {
+	ult_register_klt();
+	ult_unregister_klt();
+	return NULL;
+}
+
+/* thread-per-request pattern: create a thread that registers once */
+static void bench_register_thread() {
+	struct timespec tstart, tend;
+	ult_init();
+	clock_gettime(CLOCK_MONOTONIC_RAW, &tstart);
+	for (int i = 0; i < REGISTRATIONS / 10; i++) {
+		pthread_t thread;
+		pthread_create(&thread, NULL, register_thread, NULL);
+		pthread_join(thread, NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC_RAW, &tend);
+	ult_deinit();
+	double result = ((double) tend.tv_sec - tstart.tv_sec) + (double) (tend.tv_nsec - tstart.tv_nsec) / 1e9;
+	printf("%f s for %d threads, %e s/iter\n", result, REGISTRATIONS / 10, result * 10 / REGISTRATIONS);
+}
+
+static void bench_migrations() {
 	ult_register_klt();
 	assert(ult_registered());
 	ult_migrate(1);
-	if (argc == 2) {
-		if (strcmp(argv[1], "overall") == 0)
-			bench_overall();
-		if (strcmp(argv[1], "split") == 0)
-			bench_split();
-	} else {
-		printf("Usage: %s <overall/split>\n", argv[0]);
+	bench_overall();
+	ult_unregister_klt();
+}
+
+/* runs the overall benchmark with each backend in turn, in a new process each
+ * as the backend is fixed once selected */
+static void bench_all() {
+	static const char *backends[] = {"mwait", "futex", "affinity", "pstate", "dummy"};
+	for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid == 0) {
+			ult_set_backend(backends[i]);
+			if (strcmp(ult_backend_name(), backends[i]) != 0) {
+				printf("%s: not available\n", backends[i]);
+				fflush(stdout);
+				_exit(0);
+			}
+			printf("%s: ", backends[i]);
+			bench_migrations();
+			fflush(stdout);
+			_exit(0);
+		}
+		waitpid(pid, NULL, 0);
+	}
+}
+
+int main(int argc, char **argv) {
+	if (argc != 2) {
+		printf("Usage: %s <overall/split/register/register-lazy/register-thread/all>\n", argv[0]);
 		return 1;
 	}
+	if (strcmp(argv[1], "all") == 0) {
+		bench_all();
+		return 0;
+	}
+	/* the registration benchmarks run unregistered */
+	if (strcmp(argv[1], "register") == 0) {
+		bench_register();
+		return 0;
+	}
+	if (strcmp(argv[1], "register-lazy") == 0) {
+		bench_register_lazy();
+		return 0;
+	}
+	if (strcmp(argv[1], "register-thread") == 0) {
+		bench_register_thread();
+		return 0;
+	}
+	ult_register_klt();
+	assert(ult_registered());
+	ult_migrate(1);
+	if (strcmp(argv[1], "overall") == 0)
+		bench_overall();
+	if (strcmp(argv[1], "split") == 0)
+		bench_split();
 	ult_unregister_klt();
 	return 0;
 }
@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include "msrtools.h"
 #include "amdccx.h"
@@ -33,10 +34,7 @@ static const uint32_t
 	MPerf          = 0x000000e7,
 	APerf          = 0x000000e8,
 	MPerfReadOnly  = 0xc00000e7,
-	APerfReadOnly  = 0xc00000e8,
-	RAPLPowerUnit  = 0xc0010299,
-	CoreEnergyStat = 0xc001029a,
-	PkgEnergyStat  = 0xc001029b;
+	APerfReadOnly  = 0xc00000e8;
 
 // Components of the PStateCurLim register.
 union PStateCurLim {
@@ -106,12 +104,26 @@ static void print_frequency_info(int which_cpu, int duration) {
 		}
 		usleep(duration * 1000);
 	}
-	cpu_loop(cpu, which_cpu) {
-		mperf = rdmsr_on_cpu(MPerf, cpu);
-		aperf = rdmsr_on_cpu(APerf, cpu);
-		mperf_ro = rdmsr_on_cpu(MPerfReadOnly, cpu);
-		aperf_ro = rdmsr_on_cpu(APerfReadOnly, cpu);
-		p0freq = CoreCOF((union PStateDef) {.value = rdmsr_on_cpu(PStateDef, cpu)});
+	// Read all CPUs at once, so that the values are close in time.
+	static const uint32_t regs[] = {MPerf, APerf, MPerfReadOnly, APerfReadOnly, PStateDef};
+	const int nregs = sizeof(regs) / sizeof(regs[0]);
+	int ncpus = 0, *cpus = malloc(sysconf(_SC_NPROCESSORS_ONLN) * sizeof(int));
+	cpu_loop(cpu, which_cpu)
+		cpus[ncpus++] = cpu;
+	uint64_t *values = malloc(ncpus * nregs * sizeof(uint64_t));
+	int err = msr_read_batch(cpus, ncpus, regs, nregs, values);
+	if (err) {
+		fprintf(stderr, "rdmsr: %s\n", strerror(-err));
+		exit(4);
+	}
+	for (int i = 0; i < ncpus; i++) {
+		uint64_t *v = &values[i * nregs];
+		cpu = cpus[i];
+		mperf = v[0];
+		aperf = v[1];
+		mperf_ro = v[2];
+		aperf_ro = v[3];
+		p0freq = CoreCOF((union PStateDef) {.value = v[4]});
 		freq = p0freq * ((long double) aperf / mperf);
 		freq_ro = p0freq * ((long double) aperf_ro / mperf_ro);
 		printf("CPU %2d: P0 frequency = %d MHz\n", cpu, p0freq);
@@ -119,42 +131,93 @@ static void print_frequency_info(int which_cpu, int duration) {
 		if (duration > 0)
 			printf("CPU %2d: effective frequency      = %d MHz\n", cpu, freq);
 	}
+	free(values);
+	free(cpus);
 }
 
-// From CodeXL/Components/PowerProfiling/Backend/AMDTPowerProfileAPI/src/PowerProfile{Translate.cpp,Helper.h}
-#define ZEPPELIN_ENERGY_VAL 0x10
-static uint32_t rapl_get_energy_unit()
-{
-	uint64_t data = rdmsr_on_cpu(RAPLPowerUnit, 0);
-    return (uint8_t)((data & 0x1F00) >> 8) ? (uint8_t)((data & 0x1F00) >> 8) : ZEPPELIN_ENERGY_VAL;
-}
+// Prints the effective frequency of each CPU in MHz over every interval,
+// computed from the deltas of the read-only APerf and MPerf copies, so that
+// it doesn't interfere with the frequency command. Each line starts with the
+// wall-clock time with milliseconds like tools/energysampler -d. CPUs that
+// were mostly idle during an interval get an empty field.
+static void monitor_frequency(int which_cpu, int interval, long count) {
+	int ncpus = 0, cpu, *cpus = malloc(sysconf(_SC_NPROCESSORS_ONLN) * sizeof(int));
+	cpu_loop(cpu, which_cpu)
+		cpus[ncpus++] = cpu;
+	static const uint32_t regs[] = {MPerfReadOnly, APerfReadOnly};
+	const int nregs = sizeof(regs) / sizeof(regs[0]);
+	uint64_t *values = malloc(ncpus * nregs * sizeof(uint64_t));
+	uint64_t *last = malloc(ncpus * nregs * sizeof(uint64_t));
+	uint64_t *def = malloc(ncpus * sizeof(uint64_t));
+	// MPerf counts at the P0 frequency, which `def` may change during a
+	// benchmark. Reading PStateDef every interval would double the MSR
+	// accesses, so it's refreshed about once per second.
+	const uint32_t def_reg = PStateDef;
+	const long def_period = interval < 1000 ? 1000 / interval : 1;
 
-static void print_rapl_info(int which_cpu, uint32_t duration) {
-	uint32_t pkg_energy, core_energy;
-	uint32_t last_pkg_energy = 0, last_core_energy[128] = {0};
-	double unit = pow(2, rapl_get_energy_unit());
-	int cpu, core;
-	for (;;) {
-		pkg_energy = rdmsr_on_cpu(PkgEnergyStat, which_cpu >= 0 ? which_cpu : 0);
-		if (last_pkg_energy) {
-			printf("Package Power = %f W\n", (pkg_energy - last_pkg_energy) / unit * 1000 / duration);
+	printf("time");
+	for (int i = 0; i < ncpus; i++)
+		printf("\tcpu%d", cpus[i]);
+	printf("\n");
+
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (long n = 0; count <= 0 || n <= count; n++) {
+		int err = 0;
+		if (n % def_period == 0)
+			err = msr_read_batch(cpus, ncpus, &def_reg, 1, def);
+		// Read all CPUs at once, so that the intervals line up.
+		if (!err)
+			err = msr_read_batch(cpus, ncpus, regs, nregs, values);
+		if (err) {
+			fprintf(stderr, "rdmsr: %s\n", strerror(-err));
+			exit(4);
 		}
-		last_pkg_energy = pkg_energy;
-		cpu_loop(cpu, ALL_CPUS) {
-			if (cpu % 2) continue;
-			core = cpu / 2;
-			core_energy = rdmsr_on_cpu(CoreEnergyStat, cpu);
-			if (last_core_energy[core])
-				printf("Core %d: Core Power = %5f W\n", core, (core_energy - last_core_energy[core]) / unit * 1000 / duration);
-			last_core_energy[core] = core_energy;
+		if (n > 0) {
+			struct timespec now;
+			clock_gettime(CLOCK_REALTIME, &now);
+			char buf[32];
+			struct tm tm;
+			localtime_r(&now.tv_sec, &tm);
+			strftime(buf, sizeof buf, "%FT%T", &tm);
+			printf("%s,%03ld", buf, now.tv_nsec / 1000000);
+			strftime(buf, sizeof buf, "%z", &tm);
+			printf("%s", buf);
+			for (int i = 0; i < ncpus; i++) {
+				uint64_t dm = values[i * nregs] - last[i * nregs];
+				uint64_t da = values[i * nregs + 1] - last[i * nregs + 1];
+				int p0freq = CoreCOF((union PStateDef) {.value = def[i]});
+				// MPerf stops in C-states. Reading the MSRs wakes each CPU
+				// with an IPI, so an idle CPU still counts a few
+				// microseconds at whatever frequency it wakes up at.
+				// Below 1% of the interval, the ratio says nothing.
+				uint64_t min_dm = (uint64_t) (p0freq > 0 ? p0freq : 0) * interval * 10;
+				if (dm > 0 && dm >= min_dm)
+					printf("\t%d", (int) (p0freq * ((long double) da / dm)));
+				else
+					printf("\t");
+			}
+			printf("\n");
+			fflush(stdout);
 		}
-		usleep(duration * 1000);
+		memcpy(last, values, ncpus * nregs * sizeof(uint64_t));
+
+		next.tv_nsec += interval * 1000000l;
+		while (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
 	}
+	free(def);
+	free(last);
+	free(values);
+	free(cpus);
 }
 
 static void usage(char *argv0) {
 	fprintf(stderr, "Usage: %s [-c cpu] COMMAND\n", argv0);
-	fprintf(stderr, "where COMMAND := { status | frequency | change | def | rapl }\n");
+	fprintf(stderr, "where COMMAND := { status | frequency | monitor | change | def }\n");
 	exit(1);
 }
 
@@ -234,6 +297,14 @@ int main(int argc, char *argv[]) {
 		print_pstate_info(cpu);
 	} else if (strcmp(cmd, "frequency") == 0) {
 		print_frequency_info(cpu, optind+1 < argc ? atoi(argv[optind+1]) : 0);
+	} else if (strcmp(cmd, "monitor") == 0) {
+		int interval = optind+1 < argc ? atoi(argv[optind+1]) : 10;
+		long count = optind+2 < argc ? atol(argv[optind+2]) : 0;
+		if (interval <= 0) {
+			fprintf(stderr, "Usage: %s monitor [INTERVAL_MS [COUNT]]\n\n", argv[0]);
+			usage(argv[0]);
+		}
+		monitor_frequency(cpu, interval, count);
 	} else if (strcmp(cmd, "change") == 0) {
 		if (optind+1 >= argc) {
 change_usage:
@@ -245,9 +316,6 @@ change_usage:
 		wrmsr_on_cpu(PStateCtl, cpu, (uint64_t) state);
 	} else if (strcmp(cmd, "def") == 0) {
 		def_pstate(argc - optind, argv + optind);
-	} else if (strcmp(cmd, "rapl") == 0) {
-		uint32_t duration = optind+1 <= argc ? atoi(argv[optind+1]) : 1000;
-		print_rapl_info(cpu, duration);
 	} else {
 		usage(argv[0]);
 	}
@@ -0,0 +1,171 @@
+/*
+ * Copyright © 2018, Lukas Werling
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* cputopo
+ *
+ * Prints the CPU model from topo/cputopo.h and the CPUs of the core classes
+ * derived from it. With -e, prints only the FAST_CPU and SLOW_CPU assignments
+ * and the helper CPUs of the benchmark scripts for use with eval in shell
+ * scripts.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../topo/cputopo.h"
+
+static void usage(char *argv0) {
+	fprintf(stderr, "Usage: %s [-e] [-p]\n", argv0);
+	fprintf(stderr, "  -e  print shell variable assignments for FAST_CPU and SLOW_CPU, and for\n");
+	fprintf(stderr, "      IDLE_FAST_CPU, IDLE_SLOW_CPU, OCCX_CPU and OTHER_CPU of the benchmarks\n");
+	fprintf(stderr, "  -p  probe L3 cache positions with the Ryzen L3 PMCs (needs msr)\n");
+}
+
+// Marks the physical cores of the CPUs in a comma-separated list as used.
+static void use_list(const struct cputopo *topo, const char *list, char *used) {
+	for (const char *p = list; *p; p++) {
+		int cpu = atoi(p);
+		for (int i = 0; i < topo->count; i++)
+			if (topo->cpus[i].cpu == cpu)
+				used[i] = 1;
+		while (p[1] && *p != ',')
+			p++;
+	}
+	for (int i = 0; i < topo->count; i++)
+		for (int j = 0; j < topo->count; j++)
+			if (used[j] && topo->cpus[i].core >= 0 && topo->cpus[i].core == topo->cpus[j].core)
+				used[i] = 1;
+}
+
+// Returns the index of the first unused physical core, on the L3 cache `l3`
+// (same = 1) or on a different one (same = 0) if possible, or -1.
+static int free_core(const struct cputopo *topo, const char *used, int l3, int same) {
+	int fallback = -1;
+	for (int i = 0; i < topo->count; i++) {
+		const struct cputopo_cpu *c = &topo->cpus[i];
+		if (used[i] || (c->core >= 0 && c->core != c->cpu))
+			continue;
+		if ((c->l3 == l3) == same)
+			return i;
+		if (fallback < 0)
+			fallback = i;
+	}
+	return fallback;
+}
+
+// Prints the value of an environment variable, unless it is unset or "auto",
+// or the given CPU.
+static void print_var(const char *name, const struct cputopo *topo, char *used, int index) {
+	const char *env = getenv(name);
+	if (env != NULL && *env != '\0' && strcmp(env, "auto") != 0) {
+		printf(" %s=%s", name, env);
+		use_list(topo, env, used);
+		return;
+	}
+	if (index >= 0) {
+		printf(" %s=%d", name, topo->cpus[index].cpu);
+		used[index] = 1;
+	} else {
+		printf(" %s=%d", name, topo->count > 0 ? topo->cpus[topo->count - 1].cpu : 0);
+	}
+}
+
+// Picks the helper CPUs of the benchmark scripts, all on physical cores
+// outside the core classes: a CPU on another L3 cache than the fast class
+// (OCCX_CPU), two cores sharing an L3 cache for ult_idle, and the last free
+// CPU for monitoring (OTHER_CPU).
+static int print_benchmark_cpus(const char *fast, const char *slow) {
+	struct cputopo topo;
+	if (cputopo_load(&topo) != 0)
+		return -1;
+	char *used = calloc(topo.count, 1);
+	use_list(&topo, fast, used);
+	use_list(&topo, slow, used);
+	int fast_l3 = -1;
+	for (int i = 0; i < topo.count; i++)
+		if (topo.cpus[i].cpu == atoi(fast))
+			fast_l3 = topo.cpus[i].l3;
+
+	// Monitoring goes to the last CPU, so reserve it first.
+	int other = -1;
+	for (int i = topo.count - 1; i >= 0 && other < 0; i--)
+		if (!used[i])
+			other = i;
+	if (other >= 0)
+		used[other] = 1;
+	print_var("OCCX_CPU", &topo, used, free_core(&topo, used, fast_l3, 0));
+	int idle = free_core(&topo, used, -1, 0);
+	print_var("IDLE_FAST_CPU", &topo, used, idle);
+	print_var("IDLE_SLOW_CPU", &topo, used,
+	          free_core(&topo, used, idle >= 0 ? topo.cpus[idle].l3 : -1, 1));
+	if (other >= 0)
+		used[other] = 0;
+	print_var("OTHER_CPU", &topo, used, other);
+	free(used);
+	cputopo_free(&topo);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int env = 0, probe = 0, opt;
+	while ((opt = getopt(argc, argv, "ep")) != -1) {
+		switch (opt) {
+		case 'e': env = 1; break;
+		case 'p': probe = 1; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (env) {
+		const char *fast = cputopo_class_cpus(0), *slow = cputopo_class_cpus(1);
+		if (fast == NULL || slow == NULL) {
+			fprintf(stderr, "cputopo: couldn't derive core classes\n");
+			return 1;
+		}
+		printf("FAST_CPU=%s SLOW_CPU=%s", fast, slow);
+		if (print_benchmark_cpus(fast, slow) != 0) {
+			fprintf(stderr, "cputopo: couldn't read the CPU topology\n");
+			return 1;
+		}
+		printf("\n");
+		return 0;
+	}
+
+	struct cputopo topo;
+	if (cputopo_load(&topo) != 0) {
+		fprintf(stderr, "cputopo: couldn't read the CPU topology\n");
+		return 1;
+	}
+	if (probe)
+		cputopo_probe_l3(&topo);
+	printf("cpu\tcore\tl2\tl3\tpackage\tnode\tapic\tl3core\tl3thread\tmax_khz\tcur_khz\tcapacity\n");
+	for (int i = 0; i < topo.count; i++) {
+		struct cputopo_cpu *c = &topo.cpus[i];
+		printf("%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%u\t%u\t%u\n",
+		       c->cpu, c->core, c->l2, c->l3, c->package, c->numa_node, c->apic_id,
+		       c->l3_core, c->l3_thread, c->max_khz, c->cur_khz, c->capacity);
+	}
+	char fast[256], slow[256];
+	if (cputopo_classes(&topo, fast, slow, sizeof fast) == 0)
+		printf("\nFAST_CPU=%s SLOW_CPU=%s\n", fast, slow);
+	else
+		printf("\nno core classes (need at least two physical cores)\n");
+	cputopo_free(&topo);
+	return 0;
+}
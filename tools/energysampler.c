@@ -0,0 +1,306 @@
+/*
+ * Copyright © 2018, Lukas Werling
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* energysampler
+ *
+ * Samples the RAPL energy counters of all packages and physical cores at
+ * millisecond resolution and writes binary records to stdout until it gets
+ * SIGINT, SIGTERM or SIGHUP. Reads CoreEnergyStat and PkgEnergyStat on Ryzen
+ * via /dev/cpu/N/msr, or the powercap package and core zones otherwise, which
+ * don't have per-core counters.
+ *
+ * With -d, decodes such a file to a TSV with the average power in watts, as
+ * analyzed by benchmark/power_log.awk.
+ *
+ * File format, native byte order:
+ *
+ *   struct header;
+ *   struct domain[header.ndomains];
+ *   records of { int64_t time_ns; uint64_t energy[header.ndomains]; }
+ *
+ * time_ns is CLOCK_REALTIME. energy is the counter value since the start in
+ * units of header.unit joules, already corrected for the wraparound of the
+ * hardware counters.
+ */
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "rapl.h"
+#include "../topo/cputopo.h"
+
+#define MAGIC "ENERGY01"
+
+struct header {
+	char magic[8];
+	uint32_t ndomains;
+	uint32_t interval_us;
+	double unit;
+};
+
+enum { DOMAIN_PACKAGE, DOMAIN_CORE };
+
+struct domain {
+	int32_t type;
+	// CPU the counter is read on, -1 for the powercap core zone which covers
+	// all cores of the package.
+	int32_t cpu;
+	// Package or physical core index.
+	int32_t index;
+	int32_t _pad;
+};
+
+static struct header header;
+static struct domain *domains;
+static struct rapl_counter *counters;
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig) {
+	(void) sig;
+	stop = 1;
+}
+
+static struct rapl_counter *add_domain(int type, int cpu, int index) {
+	int n = header.ndomains++;
+	domains = realloc(domains, header.ndomains * sizeof(*domains));
+	counters = realloc(counters, header.ndomains * sizeof(*counters));
+	domains[n] = (struct domain) {.type = type, .cpu = cpu, .index = index};
+	return &counters[n];
+}
+
+// Drops the domains of a failed setup.
+static void clear_domains(void) {
+	for (unsigned i = 0; i < header.ndomains; i++)
+		rapl_close(&counters[i]);
+	header.ndomains = 0;
+}
+
+// One package counter per package and one core counter per physical core,
+// read on the first CPU of each. Only with per-core MSRs, i.e., on Ryzen.
+static int setup_msr(const struct cputopo *topo) {
+	struct rapl_msrs msrs;
+	if (rapl_msrs(&msrs) || !msrs.core_per_core || topo->count == 0 ||
+	    rapl_msr_unit(topo->cpus[0].cpu, &msrs, &header.unit))
+		return -1;
+
+	int packages = 0, cores = 0;
+	for (int i = 0; i < topo->count; i++) {
+		const struct cputopo_cpu *c = &topo->cpus[i];
+		int first = 1;
+		for (int j = 0; j < i; j++)
+			if (topo->cpus[j].package == c->package)
+				first = 0;
+		if (first && rapl_open_msr(add_domain(DOMAIN_PACKAGE, c->cpu, packages++), c->cpu, msrs.package))
+			goto fail;
+	}
+	for (int i = 0; i < topo->count; i++) {
+		const struct cputopo_cpu *c = &topo->cpus[i];
+		if ((c->core < 0 || c->core == c->cpu) &&
+		    rapl_open_msr(add_domain(DOMAIN_CORE, c->cpu, cores++), c->cpu, msrs.core))
+			goto fail;
+	}
+	return 0;
+fail:
+	clear_domains();
+	return -1;
+}
+
+// Package zones and their "core" subzones.
+static int setup_powercap() {
+	header.unit = 1e-6;
+	for (int pkg = 0; ; pkg++) {
+		char zone[64], sub[128];
+		if (rapl_powercap_zone(pkg, zone, sizeof zone))
+			break;
+		if (rapl_open_powercap(add_domain(DOMAIN_PACKAGE, -1, pkg), zone))
+			goto fail;
+		if (rapl_powercap_core_zone(zone, sub, sizeof sub) == 0 &&
+		    rapl_open_powercap(add_domain(DOMAIN_CORE, -1, pkg), sub))
+			goto fail;
+	}
+	return header.ndomains > 0 ? 0 : -1;
+fail:
+	clear_domains();
+	return -1;
+}
+
+static int64_t now_ns(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+static void sample(unsigned interval_us, const char *source) {
+	struct cputopo topo;
+	if (cputopo_load(&topo) != 0) {
+		fprintf(stderr, "energysampler: couldn't read the CPU topology\n");
+		exit(1);
+	}
+	if ((strcmp(source, "powercap") == 0 || setup_msr(&topo) != 0) &&
+	    (strcmp(source, "msr") == 0 || setup_powercap() != 0)) {
+		fprintf(stderr, "energysampler: no RAPL energy counters via %s\n",
+		        strcmp(source, "msr") == 0 ? "msr" : "msr or powercap");
+		exit(2);
+	}
+	cputopo_free(&topo);
+
+	memcpy(header.magic, MAGIC, sizeof header.magic);
+	header.interval_us = interval_us;
+	fwrite(&header, sizeof header, 1, stdout);
+	fwrite(domains, sizeof *domains, header.ndomains, stdout);
+
+	struct sigaction sa = {.sa_handler = on_signal};
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	// Sample on a fixed grid, so that the timestamps don't drift with the
+	// time spent reading. Flush about once per second.
+	unsigned flush_every = interval_us < 1000000 ? 1000000 / interval_us : 1, n = 0;
+	int64_t *record = malloc(sizeof(int64_t) * (1 + header.ndomains));
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (!stop) {
+		// A failed read keeps the last total, the next one catches up.
+		for (unsigned i = 0; i < header.ndomains; i++) {
+			rapl_sample(&counters[i]);
+			record[1 + i] = counters[i].total;
+		}
+		record[0] = now_ns(CLOCK_REALTIME);
+		fwrite(record, sizeof(int64_t), 1 + header.ndomains, stdout);
+		if (++n % flush_every == 0)
+			fflush(stdout);
+
+		next.tv_nsec += interval_us * 1000l;
+		while (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		// Skip missed samples instead of catching up with a burst.
+		if (now_ns(CLOCK_MONOTONIC) > next.tv_sec * 1000000000ll + next.tv_nsec)
+			clock_gettime(CLOCK_MONOTONIC, &next);
+		else
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+	fflush(stdout);
+	free(record);
+}
+
+static void print_time(int64_t time_ns) {
+	char buf[64];
+	time_t sec = time_ns / 1000000000;
+	struct tm tm;
+	localtime_r(&sec, &tm);
+	strftime(buf, sizeof buf, "%FT%T", &tm);
+	printf("%s,%03d", buf, (int) (time_ns / 1000000 % 1000));
+	strftime(buf, sizeof buf, "%z", &tm);
+	printf("%s", buf);
+}
+
+// Prints the average power over windows of `window_us`, or between every two
+// records with 0. Columns: time (end of the window), package (sum of all
+// packages), one per core counter.
+static void decode(FILE *in, unsigned window_us) {
+	if (fread(&header, sizeof header, 1, in) != 1 || memcmp(header.magic, MAGIC, sizeof header.magic) != 0) {
+		fprintf(stderr, "energysampler: not an energy sample file\n");
+		exit(1);
+	}
+	domains = malloc(header.ndomains * sizeof(*domains));
+	if (fread(domains, sizeof *domains, header.ndomains, in) != header.ndomains) {
+		fprintf(stderr, "energysampler: truncated header\n");
+		exit(1);
+	}
+
+	printf("time\tpackage");
+	for (unsigned i = 0; i < header.ndomains; i++) {
+		if (domains[i].type != DOMAIN_CORE)
+			continue;
+		if (domains[i].cpu < 0)
+			printf("\tcores%d", domains[i].index);
+		else
+			printf("\tcore%d", domains[i].index);
+	}
+	printf("\n");
+
+	size_t size = 1 + header.ndomains;
+	int64_t *record = malloc(sizeof(int64_t) * size), *start = malloc(sizeof(int64_t) * size);
+	if (fread(start, sizeof(int64_t), size, in) != size)
+		return;
+	while (fread(record, sizeof(int64_t), size, in) == size) {
+		double seconds = (record[0] - start[0]) / 1e9;
+		if (seconds <= 0 || seconds * 1e6 < window_us)
+			continue;
+		double package = 0;
+		for (unsigned i = 0; i < header.ndomains; i++)
+			if (domains[i].type == DOMAIN_PACKAGE)
+				package += (uint64_t) (record[1 + i] - start[1 + i]) * header.unit / seconds;
+		print_time(record[0]);
+		printf("\t%f", package);
+		for (unsigned i = 0; i < header.ndomains; i++)
+			if (domains[i].type == DOMAIN_CORE)
+				printf("\t%f", (uint64_t) (record[1 + i] - start[1 + i]) * header.unit / seconds);
+		printf("\n");
+		memcpy(start, record, sizeof(int64_t) * size);
+	}
+	free(record);
+	free(start);
+}
+
+static void usage(char *argv0) {
+	fprintf(stderr, "Usage: %s [-i interval_ms] [-s msr|powercap] > FILE\n", argv0);
+	fprintf(stderr, "       %s -d [-a window_ms] [FILE]\n", argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	double interval_ms = 1, window_ms = 0;
+	const char *source = "any";
+	int decode_mode = 0, opt;
+	while ((opt = getopt(argc, argv, "i:s:da:")) != -1) {
+		switch (opt) {
+		case 'i': interval_ms = atof(optarg); break;
+		case 's': source = optarg; break;
+		case 'd': decode_mode = 1; break;
+		case 'a': window_ms = atof(optarg); break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	// The sampler works in whole microseconds.
+	if (interval_ms < 0.001 || interval_ms > 1e6 || window_ms < 0)
+		usage(argv[0]);
+
+	if (decode_mode) {
+		FILE *in = stdin;
+		if (optind < argc && (in = fopen(argv[optind], "rb")) == NULL) {
+			perror(argv[optind]);
+			return 1;
+		}
+		decode(in, window_ms * 1000);
+		return 0;
+	}
+	if (isatty(STDOUT_FILENO)) {
+		fprintf(stderr, "energysampler: not writing binary records to a terminal\n");
+		usage(argv[0]);
+	}
+	sample(interval_ms * 1000, source);
+	return 0;
+}
@@ -0,0 +1,168 @@
+/*
+ * Copyright © 2018, Lukas Werling
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* migcost
+ *
+ * Measures the cost of migrating between every pair of CPUs with
+ * libultmigration: the round-trip latency of a migration there and back, and
+ * the time for re-reading a buffer after the migration compared to reading it
+ * on the original CPU (cache refill). The results are written in the format
+ * expected by ULT_COST_MATRIX and printed as a table.
+ */
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../ultmigration.h"
+
+static int iterations = 10000;
+static size_t buffer_size = 256 * 1024;
+static int refills = 20;
+
+static volatile uint64_t sink;
+
+static double now_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static double read_buffer_ns(const char *buffer) {
+	uint64_t sum = 0;
+	double start = now_ns();
+	for (size_t i = 0; i < buffer_size; i += 64)
+		sum += buffer[i];
+	double end = now_ns();
+	sink += sum;
+	return end - start;
+}
+
+/* measures migrations from `from` to `to` and back, in ns */
+static void measure(int from, int to, char *buffer, double *roundtrip, double *refill) {
+	char cpu[16];
+	snprintf(cpu, sizeof cpu, "%d", from);
+	setenv("FAST_CPU", cpu, 1);
+	snprintf(cpu, sizeof cpu, "%d", to);
+	setenv("SLOW_CPU", cpu, 1);
+
+	/* the pool threads start with the registration */
+	ult_register_klt();
+	ult_migrate(ULT_FAST);
+	for (int i = 0; i < iterations / 10; i++) {
+		ult_migrate(ULT_SLOW);
+		ult_migrate(ULT_FAST);
+	}
+	double start = now_ns();
+	for (int i = 0; i < iterations; i++) {
+		ult_migrate(ULT_SLOW);
+		ult_migrate(ULT_FAST);
+	}
+	*roundtrip = (now_ns() - start) / iterations;
+
+	double local = 0, remote = 0;
+	for (int i = 0; i < refills; i++) {
+		memset(buffer, i, buffer_size);
+		read_buffer_ns(buffer);
+		local += read_buffer_ns(buffer);
+		memset(buffer, i, buffer_size);
+		ult_migrate(ULT_SLOW);
+		remote += read_buffer_ns(buffer);
+		ult_migrate(ULT_FAST);
+	}
+	*refill = (remote - local) / refills;
+	ult_unregister_klt();
+}
+
+static void usage(char *argv0) {
+	fprintf(stderr, "Usage: %s [-n iterations] [-s buffer KiB] [-o file] [cpu...]\n", argv0);
+	fprintf(stderr, "Measures all pairs of the given CPUs, default all online CPUs.\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	const char *output = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:s:o:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 's':
+			buffer_size = strtoul(optarg, NULL, 0) * 1024;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (iterations <= 0 || buffer_size == 0)
+		usage(argv[0]);
+
+	int ncpus = argc - optind;
+	int *cpus;
+	if (ncpus > 0) {
+		cpus = malloc(ncpus * sizeof(int));
+		for (int i = 0; i < ncpus; i++)
+			cpus[i] = atoi(argv[optind + i]);
+	} else {
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		cpus = malloc(ncpus * sizeof(int));
+		for (int i = 0; i < ncpus; i++)
+			cpus[i] = i;
+	}
+
+	FILE *f = stdout;
+	if (output != NULL && (f = fopen(output, "w")) == NULL) {
+		perror("migcost: couldn't open output file");
+		return 1;
+	}
+	fprintf(f, "# from to roundtrip_ns refill_ns\n");
+
+	char *buffer = malloc(buffer_size);
+	double *roundtrip = malloc(ncpus * ncpus * sizeof(double));
+	for (int i = 0; i < ncpus; i++) {
+		for (int j = 0; j < ncpus; j++) {
+			double refill = 0;
+			roundtrip[i * ncpus + j] = 0;
+			if (i != j)
+				measure(cpus[i], cpus[j], buffer, &roundtrip[i * ncpus + j], &refill);
+			fprintf(f, "%d %d %.1f %.1f\n", cpus[i], cpus[j], roundtrip[i * ncpus + j], refill);
+			fflush(f);
+		}
+	}
+	if (f != stdout)
+		fclose(f);
+
+	if (output != NULL) {
+		printf("round trip [ns]\nfrom\\to");
+		for (int j = 0; j < ncpus; j++)
+			printf("\t%d", cpus[j]);
+		printf("\n");
+		for (int i = 0; i < ncpus; i++) {
+			printf("%d", cpus[i]);
+			for (int j = 0; j < ncpus; j++)
+				printf("\t%.0f", roundtrip[i * ncpus + j]);
+			printf("\n");
+		}
+	}
+	return 0;
+}
@@ -14,104 +14,228 @@
  *
  * ----------------------------------------------------------------------- */
 
-#include <assert.h>
+#define _GNU_SOURCE
+#include "msrtools.h"
+
 #include <errno.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
-#include <getopt.h>
+#include <string.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <stdint.h>
 
-static int msr_fds[64];
+// Open /dev/cpu/N/msr files, indexed by CPU. Entries hold fd + 1 so that 0
+// means not opened yet. They are opened on first use and only closed by
+// deinit_dev_msr().
+static int *msr_fds;
+static int msr_cpus;
+static pthread_once_t msr_fds_once = PTHREAD_ONCE_INIT;
 
-uint64_t rdmsr_on_cpu(uint32_t reg, int cpu)
+static void msr_alloc_fds(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_CONF);
+	msr_cpus = cpus > 0 ? cpus : 1;
+	msr_fds = calloc(msr_cpus, sizeof(*msr_fds));
+	if (msr_fds == NULL)
+		msr_cpus = 0;
+}
+
+// Returns the fd for a CPU, opening it if necessary, or a negative errno.
+static int msr_fd(int cpu)
 {
-	uint64_t data;
-	int fd;
 	char msr_file_name[64];
+	int fd, expected = 0;
 
-	fd = msr_fds[cpu];
-	if (!fd) {
-		sprintf(msr_file_name, "/dev/cpu/%d/msr", cpu);
-		fd = open(msr_file_name, O_RDONLY);
-		if (fd < 0) {
-			if (errno == ENXIO) {
-				fprintf(stderr, "rdmsr: No CPU %d\n", cpu);
-				exit(2);
-			} else if (errno == EIO) {
-				fprintf(stderr, "rdmsr: CPU %d doesn't support MSRs\n",
-					cpu);
-				exit(3);
-			} else {
-				perror("rdmsr: open");
-				exit(127);
-			}
-		}
-	}
+	pthread_once(&msr_fds_once, msr_alloc_fds);
+	if (cpu < 0 || cpu >= msr_cpus)
+		return -ENXIO;
+	fd = __atomic_load_n(&msr_fds[cpu], __ATOMIC_ACQUIRE);
+	if (fd)
+		return fd - 1;
 
-	if (pread(fd, &data, sizeof data, reg) != sizeof data) {
-		if (errno == EIO) {
-			fprintf(stderr, "rdmsr: CPU %d cannot read "
-				"MSR 0x%08"PRIx32"\n",
-				cpu, reg);
-			exit(4);
-		} else {
-			perror("rdmsr: pread");
-			exit(127);
-		}
+	sprintf(msr_file_name, "/dev/cpu/%d/msr", cpu);
+	fd = open(msr_file_name, O_RDWR | O_CLOEXEC);
+	// Reading may still be allowed.
+	if (fd < 0 && (errno == EACCES || errno == EPERM))
+		fd = open(msr_file_name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	if (!__atomic_compare_exchange_n(&msr_fds[cpu], &expected, fd + 1, 0,
+	                                 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		// Another thread was faster.
+		close(fd);
+		return expected - 1;
 	}
+	return fd;
+}
 
-	if (!msr_fds[cpu])
-		close(fd);
+int msr_open(int cpu)
+{
+	int fd = msr_fd(cpu);
+	return fd < 0 ? fd : 0;
+}
 
-	return data;
+int msr_read(int cpu, uint32_t reg, uint64_t *value)
+{
+	int fd = msr_fd(cpu);
+	if (fd < 0)
+		return fd;
+	ssize_t n = pread(fd, value, sizeof *value, reg);
+	if (n < 0)
+		return -errno;
+	// errno is only set if the call failed, not for a short read.
+	return n == sizeof *value ? 0 : -EIO;
 }
 
-void wrmsr_on_cpu(uint32_t reg, int cpu, uint64_t data)
+int msr_write(int cpu, uint32_t reg, uint64_t value)
 {
-	int fd;
-	char msr_file_name[64];
+	int fd = msr_fd(cpu);
+	if (fd < 0)
+		return fd;
+	ssize_t n = pwrite(fd, &value, sizeof value, reg);
+	if (n < 0)
+		return -errno;
+	return n == sizeof value ? 0 : -EIO;
+}
+
+struct msr_batch {
+	const int *cpus;
+	int ncpus;
+	const uint32_t *regs;
+	int nregs;
+	uint64_t *values;
+	// next index into cpus to read
+	int next;
+	int err;
+};
 
-	fd = msr_fds[cpu];
-	if (!fd) {
-		sprintf(msr_file_name, "/dev/cpu/%d/msr", cpu);
-		fd = open(msr_file_name, O_WRONLY);
-		if (fd < 0) {
-			if (errno == ENXIO) {
-				fprintf(stderr, "wrmsr: No CPU %d\n", cpu);
-				exit(2);
-			} else if (errno == EIO) {
-				fprintf(stderr, "wrmsr: CPU %d doesn't support MSRs\n",
-					cpu);
-				exit(3);
-			} else {
-				perror("wrmsr: open");
-				exit(127);
-			}
+static void *msr_batch_worker(void *arg)
+{
+	struct msr_batch *batch = arg;
+	int i, j, err, expected;
+	while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->ncpus) {
+		for (j = 0; j < batch->nregs; j++) {
+			err = msr_read(batch->cpus[i], batch->regs[j],
+			               &batch->values[i * batch->nregs + j]);
+			expected = 0;
+			if (err)
+				__atomic_compare_exchange_n(&batch->err, &expected, err, 0,
+				                            __ATOMIC_RELAXED, __ATOMIC_RELAXED);
 		}
 	}
+	return NULL;
+}
 
-	if (pwrite(fd, &data, sizeof data, reg) != sizeof data) {
-		if (errno == EIO) {
-			fprintf(stderr,
-				"wrmsr: CPU %d cannot set MSR "
-				"0x%08"PRIx32" to 0x%016"PRIx64"\n",
-				cpu, reg, data);
-			exit(4);
-		} else {
-			perror("wrmsr: pwrite");
-			exit(127);
-		}
+// Worker threads of msr_read_batch(). They start on first use and wait for
+// later batches instead of being created for every batch. Batches run one at
+// a time under msr_batch_call_mutex, msr_batch_mutex hands them to the
+// workers.
+static pthread_mutex_t msr_batch_call_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t msr_batch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t msr_batch_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t msr_batch_done = PTHREAD_COND_INITIALIZER;
+static struct msr_batch *msr_batch_current;
+static unsigned long msr_batch_generation;
+static int msr_batch_workers, msr_batch_busy;
+
+static void *msr_batch_thread(void *arg)
+{
+	// Generation of the last batch before this thread started.
+	unsigned long generation = (uintptr_t) arg;
+	struct msr_batch *batch;
+
+	pthread_mutex_lock(&msr_batch_mutex);
+	while (1) {
+		while (msr_batch_generation == generation)
+			pthread_cond_wait(&msr_batch_start, &msr_batch_mutex);
+		generation = msr_batch_generation;
+		batch = msr_batch_current;
+		pthread_mutex_unlock(&msr_batch_mutex);
+		msr_batch_worker(batch);
+		pthread_mutex_lock(&msr_batch_mutex);
+		if (--msr_batch_busy == 0)
+			pthread_cond_signal(&msr_batch_done);
 	}
+	return NULL;
+}
 
-	if (!msr_fds[cpu])
-		close(fd);
+int msr_read_batch(const int *cpus, int ncpus, const uint32_t *regs, int nregs,
+                   uint64_t *values)
+{
+	struct msr_batch batch = {cpus, ncpus, regs, nregs, values, 0, 0};
+	int nthreads = ncpus < MSR_BATCH_THREADS ? ncpus : MSR_BATCH_THREADS;
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	pthread_mutex_lock(&msr_batch_call_mutex);
+	// Every read waits for an interrupt on the target CPU, so reading from
+	// several threads overlaps them. The calling thread is one of them.
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	while (msr_batch_workers < nthreads - 1 &&
+	       pthread_create(&thread, &attr, msr_batch_thread,
+	                      (void *) (uintptr_t) msr_batch_generation) == 0)
+		msr_batch_workers++;
+	pthread_attr_destroy(&attr);
+
+	pthread_mutex_lock(&msr_batch_mutex);
+	msr_batch_current = &batch;
+	msr_batch_busy = msr_batch_workers;
+	msr_batch_generation++;
+	pthread_cond_broadcast(&msr_batch_start);
+	pthread_mutex_unlock(&msr_batch_mutex);
+
+	msr_batch_worker(&batch);
+
+	pthread_mutex_lock(&msr_batch_mutex);
+	while (msr_batch_busy > 0)
+		pthread_cond_wait(&msr_batch_done, &msr_batch_mutex);
+	pthread_mutex_unlock(&msr_batch_mutex);
+	pthread_mutex_unlock(&msr_batch_call_mutex);
+	return batch.err;
+}
+
+uint64_t rdmsr_on_cpu(uint32_t reg, int cpu)
+{
+	uint64_t data;
+	int err = msr_read(cpu, reg, &data);
+	if (err == -ENXIO) {
+		fprintf(stderr, "rdmsr: No CPU %d\n", cpu);
+		exit(2);
+	} else if (err == -EIO) {
+		fprintf(stderr, "rdmsr: CPU %d cannot read "
+			"MSR 0x%08"PRIx32"\n",
+			cpu, reg);
+		exit(4);
+	} else if (err) {
+		fprintf(stderr, "rdmsr: %s\n", strerror(-err));
+		exit(127);
+	}
+	return data;
+}
 
-	return;
+void wrmsr_on_cpu(uint32_t reg, int cpu, uint64_t data)
+{
+	int err = msr_write(cpu, reg, data);
+	if (err == -ENXIO) {
+		fprintf(stderr, "wrmsr: No CPU %d\n", cpu);
+		exit(2);
+	} else if (err == -EIO) {
+		fprintf(stderr,
+			"wrmsr: CPU %d cannot set MSR "
+			"0x%08"PRIx32" to 0x%016"PRIx64"\n",
+			cpu, reg, data);
+		exit(4);
+	} else if (err) {
+		fprintf(stderr, "wrmsr: %s\n", strerror(-err));
+		exit(127);
+	}
 }
 
 /* filter out ".", "..", "microcode" in /dev/cpu */
@@ -138,30 +262,23 @@ void wrmsr_on_all_cpus(uint32_t reg, uint64_t data)
 void init_dev_msr()
 {
 	struct dirent **namelist;
-	int dir_entries, cpu, fd;
-	char msr_file_name[64];
+	int dir_entries, cpu, err;
 
 	dir_entries = scandir("/dev/cpu", &namelist, dir_filter, 0);
 	while (dir_entries--) {
 		cpu = atoi(namelist[dir_entries]->d_name);
-		assert(cpu < sizeof(msr_fds) / sizeof(msr_fds[0]));
-
-		sprintf(msr_file_name, "/dev/cpu/%d/msr", cpu);
-		fd = open(msr_file_name, O_RDWR);
-		if (fd < 0) {
-			if (errno == ENXIO) {
-				fprintf(stderr, "msr: No CPU %d\n", cpu);
-				exit(2);
-			} else if (errno == EIO) {
-				fprintf(stderr, "msr: CPU %d doesn't support MSRs\n",
-					cpu);
-				exit(3);
-			} else {
-				perror("msr: open");
-				exit(127);
-			}
+		err = msr_open(cpu);
+		if (err == -ENXIO) {
+			fprintf(stderr, "msr: No CPU %d\n", cpu);
+			exit(2);
+		} else if (err == -EIO) {
+			fprintf(stderr, "msr: CPU %d doesn't support MSRs\n",
+				cpu);
+			exit(3);
+		} else if (err) {
+			fprintf(stderr, "msr: open: %s\n", strerror(-err));
+			exit(127);
 		}
-		msr_fds[cpu] = fd;
 
 		free(namelist[dir_entries]);
 	}
@@ -170,11 +287,11 @@ void init_dev_msr()
 
 void deinit_dev_msr()
 {
-	int i; 
-	for (i = 0; i < sizeof(msr_fds) / sizeof(msr_fds[0]); i++) {
-		if (msr_fds[i]) {
-			close(msr_fds[i]);
-			msr_fds[i] = 0;
-		}
+	int i;
+	pthread_once(&msr_fds_once, msr_alloc_fds);
+	for (i = 0; i < msr_cpus; i++) {
+		int fd = __atomic_exchange_n(&msr_fds[i], 0, __ATOMIC_ACQ_REL);
+		if (fd)
+			close(fd - 1);
 	}
 }
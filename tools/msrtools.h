@@ -3,12 +3,39 @@
 
 #include <inttypes.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Thread-safe access to /dev/cpu/N/msr. The functions returning int return 0
+// on success or a negative errno value. Device files are opened on first use
+// and stay open until deinit_dev_msr().
+int msr_open(int cpu);
+int msr_read(int cpu, uint32_t reg, uint64_t *value);
+int msr_write(int cpu, uint32_t reg, uint64_t value);
+
+// Maximum number of threads used by msr_read_batch().
+#define MSR_BATCH_THREADS 16
+
+// Reads nregs registers on each of ncpus CPUs, regs[j] of cpus[i] into
+// values[i * nregs + j]. The CPUs are read in parallel by worker threads that
+// stay around for later calls. Returns the first error, the other values are
+// still read.
+int msr_read_batch(const int *cpus, int ncpus, const uint32_t *regs, int nregs,
+                   uint64_t *values);
+
+// For tools: open all CPUs now, or close all. deinit_dev_msr() must not run
+// concurrently with other accesses.
 void init_dev_msr();
 void deinit_dev_msr();
 
+// Like msr_read() and msr_write(), but print an error and exit on failure.
 uint64_t rdmsr_on_cpu(uint32_t reg, int cpu);
 void wrmsr_on_cpu(uint32_t reg, int cpu, uint64_t data);
 void wrmsr_on_all_cpus(uint32_t reg, uint64_t data);
 
+#ifdef __cplusplus
+}
 #endif
 
+#endif
@@ -0,0 +1,142 @@
+/*
+ * Copyright © 2018, Lukas Werling
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include "rapl.h"
+#include "msrtools.h"
+
+#include <cpuid.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// AMD family 17h
+static const struct rapl_msrs amd_msrs = {0xc0010299, 0xc001029b, 0xc001029a, 1};
+// Intel
+static const struct rapl_msrs intel_msrs = {0x606, 0x611, 0x639, 0};
+
+int rapl_msrs(struct rapl_msrs *msrs) {
+	unsigned eax, ebx, ecx, edx;
+	if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx))
+		return -1;
+	if (ebx == signature_INTEL_ebx) {
+		*msrs = intel_msrs;
+		return 0;
+	}
+	if (ebx != signature_AMD_ebx)
+		return -1;
+	__get_cpuid(1, &eax, &ebx, &ecx, &edx);
+	if (((eax >> 8) & 0xf) + ((eax >> 20) & 0xff) < 0x17)
+		return -1;
+	*msrs = amd_msrs;
+	return 0;
+}
+
+int rapl_msr_unit(int cpu, const struct rapl_msrs *msrs, double *unit) {
+	uint64_t units;
+	if (msr_read(cpu, msrs->unit, &units))
+		return -1;
+	// Energy status unit in bits 12:8. Zeppelin reports 0, CodeXL uses 0x10
+	// then.
+	unsigned esu = (units >> 8) & 0x1f;
+	*unit = pow(0.5, esu ? esu : 0x10);
+	return 0;
+}
+
+int rapl_powercap_zone(int package, char *zone, size_t size) {
+	snprintf(zone, size, "/sys/class/powercap/intel-rapl:%d", package);
+	return access(zone, F_OK) == 0 ? 0 : -1;
+}
+
+int rapl_powercap_core_zone(const char *zone, char *sub, size_t size) {
+	const char *package = strrchr(zone, ':') + 1;
+	for (int i = 0; ; i++) {
+		char name[32];
+		snprintf(sub, size, "%s/intel-rapl:%s:%d/name", zone, package, i);
+		FILE *f = fopen(sub, "r");
+		if (f == NULL)
+			return -1;
+		int is_core = fscanf(f, "%31s", name) == 1 && strcmp(name, "core") == 0;
+		fclose(f);
+		if (is_core) {
+			*strrchr(sub, '/') = 0;
+			return 0;
+		}
+	}
+}
+
+static int read_uj(int fd, uint64_t *value) {
+	char buf[32];
+	ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return -1;
+	buf[len] = 0;
+	*value = strtoull(buf, NULL, 10);
+	return 0;
+}
+
+static int read_counter(const struct rapl_counter *c, uint64_t *value) {
+	if (c->cpu >= 0) {
+		if (msr_read(c->cpu, c->reg, value))
+			return -1;
+		*value &= 0xffffffff;
+		return 0;
+	}
+	return read_uj(c->fd, value);
+}
+
+int rapl_open_msr(struct rapl_counter *c, int cpu, uint32_t reg) {
+	*c = (struct rapl_counter) {.cpu = cpu, .reg = reg, .fd = -1, .range = 1ull << 32};
+	return read_counter(c, &c->last);
+}
+
+int rapl_open_powercap(struct rapl_counter *c, const char *zone) {
+	char path[160];
+	*c = (struct rapl_counter) {.cpu = -1, .fd = -1};
+	snprintf(path, sizeof path, "%s/max_energy_range_uj", zone);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	int err = read_uj(fd, &c->range);
+	close(fd);
+	if (err || c->range == 0)
+		return -1;
+	snprintf(path, sizeof path, "%s/energy_uj", zone);
+	c->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (c->fd < 0 || read_counter(c, &c->last)) {
+		rapl_close(c);
+		return -1;
+	}
+	return 0;
+}
+
+void rapl_close(struct rapl_counter *c) {
+	if (c->fd >= 0)
+		close(c->fd);
+	c->fd = -1;
+}
+
+int rapl_sample(struct rapl_counter *c) {
+	uint64_t value;
+	if (read_counter(c, &value))
+		return -1;
+	c->total += value >= c->last ? value - c->last : value + c->range - c->last;
+	c->last = value;
+	return 0;
+}
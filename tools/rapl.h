@@ -0,0 +1,75 @@
+/*
+ * Copyright © 2018, Lukas Werling
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef RAPL_H
+#define RAPL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// RAPL energy counters, read through msrtools on AMD family 17h and Intel, or
+// from the powercap zones otherwise. Shared by tools/energysampler and
+// libswp. The functions returning int return 0 on success and -1 otherwise.
+
+// Energy MSRs of the running CPU.
+struct rapl_msrs {
+	uint32_t unit, package, core;
+	// AMD counts the energy of each core, Intel's PP0 that of all cores.
+	int core_per_core;
+};
+
+int rapl_msrs(struct rapl_msrs *msrs);
+// Joules per count of the MSRs from the power unit register of `cpu`.
+int rapl_msr_unit(int cpu, const struct rapl_msrs *msrs, double *unit);
+
+// Powercap zone of a package, and its "core" subzone. The kernel uses the
+// intel-rapl names for the AMD driver, too. Counters of powercap zones count
+// microjoules.
+int rapl_powercap_zone(int package, char *zone, size_t size);
+int rapl_powercap_core_zone(const char *zone, char *sub, size_t size);
+
+// A counter and its sum since rapl_open_*(), corrected for the wraparound of
+// the hardware counter.
+struct rapl_counter {
+	// CPU and register for MSRs, cpu is -1 for powercap.
+	int cpu;
+	uint32_t reg;
+	// energy_uj of the powercap zone, -1 for MSRs.
+	int fd;
+	// Last hardware counter value and its range.
+	uint64_t last, range;
+	uint64_t total;
+};
+
+int rapl_open_msr(struct rapl_counter *c, int cpu, uint32_t reg);
+// Fails if the zone doesn't report its range, as the wraparound can't be
+// corrected then.
+int rapl_open_powercap(struct rapl_counter *c, const char *zone);
+void rapl_close(struct rapl_counter *c);
+// Adds the difference to the last read value to c->total. The hardware
+// counters wrap around after a few minutes at full load, so this has to be
+// called more often.
+int rapl_sample(struct rapl_counter *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,392 @@
+/*
+ * Copyright © 2018, Lukas Werling
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* CPU topology from sysfs and cpuid. */
+
+#define _GNU_SOURCE
+#include "cputopo.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SYSFS_CPU "/sys/devices/system/cpu"
+
+// Reads the first integer from a sysfs file, or returns `def`.
+static long read_long(const char *path, long def) {
+	long value;
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return def;
+	if (fscanf(f, "%ld", &value) != 1)
+		value = def;
+	fclose(f);
+	return value;
+}
+
+// Returns the first CPU in the shared_cpu_list of the cache with the given
+// level, or -1.
+static int cache_id(int cpu, int level) {
+	char path[128];
+	for (int index = 0; index < 8; index++) {
+		snprintf(path, sizeof path, SYSFS_CPU "/cpu%d/cache/index%d/level", cpu, index);
+		long l = read_long(path, -1);
+		if (l == -1)
+			break;
+		if (l != level)
+			continue;
+		snprintf(path, sizeof path, SYSFS_CPU "/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+		return read_long(path, -1);
+	}
+	return -1;
+}
+
+static int numa_node(int cpu) {
+	char path[128];
+	for (int node = 0; node < 1024; node++) {
+		snprintf(path, sizeof path, SYSFS_CPU "/cpu%d/node%d", cpu, node);
+		if (access(path, F_OK) == 0)
+			return node;
+	}
+	return 0;
+}
+
+// Extended APIC id from cpuid leaf 0x8000001e, like tools/amdccx.c, or the
+// initial APIC id from leaf 1.
+static int apic_id(int cpu) {
+	char path[64];
+	uint32_t regs[4];
+	int id = -1;
+	snprintf(path, sizeof path, "/dev/cpu/%d/cpuid", cpu);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (pread(fd, regs, sizeof regs, 0x80000000) == sizeof regs && regs[0] >= 0x8000001e &&
+	    pread(fd, regs, sizeof regs, 0x8000001e) == sizeof regs)
+		id = regs[0];
+	else if (pread(fd, regs, sizeof regs, 1) == sizeof regs)
+		id = regs[1] >> 24;
+	close(fd);
+	return id;
+}
+
+int cputopo_load(struct cputopo *topo) {
+	char path[128];
+	long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+	topo->count = 0;
+	topo->cpus = calloc(ncpus, sizeof(struct cputopo_cpu));
+	if (topo->cpus == NULL)
+		return -1;
+
+	unsigned max_capacity = 0, max_khz = 0;
+	int have_capacity = 1;
+	for (int cpu = 0; cpu < ncpus; cpu++) {
+		snprintf(path, sizeof path, SYSFS_CPU "/cpu%d/online", cpu);
+		// cpu0 often has no online file.
+		if (read_long(path, 1) != 1)
+			continue;
+		snprintf(path, sizeof path, SYSFS_CPU "/cpu%d/topology/core_id", cpu);
+		if (read_long(path, -1) == -1)
+			continue;
+		struct cputopo_cpu *c = &topo->cpus[topo->count++];
+		c->cpu = cpu;
+		snprintf(path, sizeof path, SYSFS_CPU "/cpu%d/topology/thread_siblings_list", cpu);
+		c->core = read_long(path, cpu);
+		snprintf(path, sizeof path, SYSFS_CPU "/cpu%d/topology/physical_package_id", cpu);
+		c->package = read_long(path, 0);
+		c->numa_node = numa_node(cpu);
+		c->l2 = cache_id(cpu, 2);
+		c->l3 = cache_id(cpu, 3);
+		c->apic_id = apic_id(cpu);
+		snprintf(path, sizeof path, SYSFS_CPU "/cpu%d/cpufreq/cpuinfo_max_freq", cpu);
+		c->max_khz = read_long(path, 0);
+		snprintf(path, sizeof path, SYSFS_CPU "/cpu%d/cpufreq/scaling_cur_freq", cpu);
+		c->cur_khz = read_long(path, 0);
+		snprintf(path, sizeof path, SYSFS_CPU "/cpu%d/cpu_capacity", cpu);
+		long capacity = read_long(path, -1);
+		if (capacity < 0)
+			have_capacity = 0;
+		c->capacity = capacity > 0 ? capacity : 0;
+		if (c->capacity > max_capacity)
+			max_capacity = c->capacity;
+		if (c->max_khz > max_khz)
+			max_khz = c->max_khz;
+	}
+
+	for (int i = 0; i < topo->count; i++) {
+		struct cputopo_cpu *c = &topo->cpus[i];
+		// Without cpu_capacity, assume that performance scales with the
+		// maximum frequency.
+		if (have_capacity && max_capacity > 0)
+			c->capacity = (uint64_t) c->capacity * 1024 / max_capacity;
+		else if (max_khz > 0)
+			c->capacity = (uint64_t) c->max_khz * 1024 / max_khz;
+		else
+			c->capacity = 1024;
+
+		// Position in the L3 cache, from the APIC id on Ryzen or by
+		// counting cores and threads sharing the cache.
+		if (c->apic_id >= 0 && c->l3 >= 0) {
+			c->l3_core = (c->apic_id & 0x7) >> 1;
+			c->l3_thread = c->apic_id & 0x1;
+		} else {
+			c->l3_core = c->l3_thread = 0;
+			for (int j = 0; j < i; j++) {
+				struct cputopo_cpu *o = &topo->cpus[j];
+				if (o->l3 == c->l3 && o->core == o->cpu && o->core != c->core)
+					c->l3_core++;
+				if (o->core == c->core)
+					c->l3_thread++;
+			}
+		}
+	}
+	return topo->count > 0 ? 0 : -1;
+}
+
+void cputopo_free(struct cputopo *topo) {
+	free(topo->cpus);
+	topo->cpus = NULL;
+	topo->count = 0;
+}
+
+// Appends a CPU to a comma-separated list.
+static void append_cpu(char *list, size_t len, int cpu) {
+	size_t used = strlen(list);
+	snprintf(list + used, len - used, used ? ",%d" : "%d", cpu);
+}
+
+// At most this many CPUs per class, see MAX_POOL_SIZE in ultmigration.c.
+#define MAX_CLASS_CPUS 16
+
+int cputopo_classes(const struct cputopo *topo, char *fast, char *slow, size_t len) {
+	unsigned min_capacity = 1024;
+	int nfast = 0, nslow = 0;
+	fast[0] = slow[0] = '\0';
+	for (int i = 0; i < topo->count; i++)
+		if (topo->cpus[i].capacity < min_capacity)
+			min_capacity = topo->cpus[i].capacity;
+
+	if (min_capacity < 1024 * 9 / 10) {
+		// Heterogeneous: one CPU per physical core in each class.
+		for (int i = 0; i < topo->count; i++) {
+			const struct cputopo_cpu *c = &topo->cpus[i];
+			if (c->core != c->cpu)
+				continue;
+			if (c->capacity >= 1024 * 9 / 10 && nfast < MAX_CLASS_CPUS) {
+				append_cpu(fast, len, c->cpu);
+				nfast++;
+			} else if (c->capacity == min_capacity && nslow < MAX_CLASS_CPUS) {
+				append_cpu(slow, len, c->cpu);
+				nslow++;
+			}
+		}
+		return nfast && nslow ? 0 : -1;
+	}
+
+	// Homogeneous: the first CPU and another physical core sharing its L3
+	// cache, so that migrations stay cheap.
+	const struct cputopo_cpu *first = &topo->cpus[0], *other = NULL;
+	for (int i = 1; i < topo->count; i++) {
+		const struct cputopo_cpu *c = &topo->cpus[i];
+		if (c->core == c->cpu && c->core != first->core &&
+		    (other == NULL || (c->l3 == first->l3 && other->l3 != first->l3)))
+			other = c;
+	}
+	if (other == NULL)
+		return -1;
+	append_cpu(fast, len, first->cpu);
+	append_cpu(slow, len, other->cpu);
+	return 0;
+}
+
+// Class lists derived from the topology, derived again on the next call after
+// cputopo_invalidate_classes(). Callers may still read the previous lists, so
+// those stay allocated.
+static pthread_mutex_t class_lists_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char (*class_lists)[256];
+static int class_lists_ok, class_lists_stale = 1;
+
+static void derive_class_lists(void) {
+	char (*lists)[256] = calloc(2, sizeof(*lists));
+	struct cputopo topo;
+	if (lists == NULL)
+		return;
+	class_lists_ok = cputopo_load(&topo) == 0 &&
+	                 cputopo_classes(&topo, lists[0], lists[1], sizeof lists[0]) == 0;
+	cputopo_free(&topo);
+	class_lists = lists;
+	class_lists_stale = 0;
+}
+
+const char *cputopo_class_cpus(int slow) {
+	const char *env = getenv(slow ? "SLOW_CPU" : "FAST_CPU");
+	const char *list;
+	if (env != NULL && *env != '\0' && strcmp(env, "auto") != 0)
+		return env;
+	pthread_mutex_lock(&class_lists_mutex);
+	if (class_lists_stale)
+		derive_class_lists();
+	list = class_lists != NULL && class_lists_ok ? class_lists[slow != 0] : NULL;
+	pthread_mutex_unlock(&class_lists_mutex);
+	return list;
+}
+
+void cputopo_invalidate_classes(void) {
+	pthread_mutex_lock(&class_lists_mutex);
+	class_lists_stale = 1;
+	pthread_mutex_unlock(&class_lists_mutex);
+}
+
+// Parses a kernel CPU list such as "0-3,8,10-11".
+static int parse_cpu_list(const char *list, cpu_set_t *set) {
+	CPU_ZERO(set);
+	while (*list != '\0' && *list != '\n') {
+		char *end;
+		long first = strtol(list, &end, 10), last = first;
+		if (end == list)
+			return -1;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+			if (end == list)
+				return -1;
+		}
+		for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, set);
+		list = *end == ',' ? end + 1 : end;
+	}
+	return 0;
+}
+
+static int read_cpu_list(const char *path, cpu_set_t *set) {
+	char line[4096];
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	int ok = fgets(line, sizeof line, f) != NULL;
+	fclose(f);
+	return ok ? parse_cpu_list(line, set) : -1;
+}
+
+// Reads the effective CPUs of the process's cpuset cgroup. Returns -1 if there
+// is none, e.g., without the cpuset controller.
+static int cgroup_cpus(cpu_set_t *set) {
+	char line[1024], path[1200];
+	int found = -1;
+	FILE *f = fopen("/proc/self/cgroup", "r");
+	if (f == NULL)
+		return -1;
+	while (found != 0 && fgets(line, sizeof line, f) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		// Lines are "ID:CONTROLLERS:PATH", with empty controllers for v2.
+		char *controllers = strchr(line, ':'), *cgroup;
+		if (controllers == NULL || (cgroup = strchr(++controllers, ':')) == NULL)
+			continue;
+		*cgroup++ = '\0';
+		if (*controllers == '\0') {
+			snprintf(path, sizeof path, "/sys/fs/cgroup%s/cpuset.cpus.effective", cgroup);
+		} else {
+			int cpuset = 0;
+			for (char *c = strtok(controllers, ","); c != NULL; c = strtok(NULL, ","))
+				cpuset |= strcmp(c, "cpuset") == 0;
+			if (!cpuset)
+				continue;
+			snprintf(path, sizeof path, "/sys/fs/cgroup/cpuset%s/cpuset.effective_cpus", cgroup);
+		}
+		found = read_cpu_list(path, set);
+	}
+	fclose(f);
+	return found;
+}
+
+int cputopo_allowed_cpus(cpu_set_t *allowed) {
+	cpu_set_t cgroup;
+	if (read_cpu_list(SYSFS_CPU "/online", allowed) != 0)
+		return -1;
+	if (cgroup_cpus(&cgroup) == 0)
+		CPU_AND(allowed, allowed, &cgroup);
+	return CPU_COUNT(allowed) > 0 ? 0 : -1;
+}
+
+// Appends the allowed CPUs of a comma-separated list.
+static void filter_cpus(const char *list, const cpu_set_t *allowed, char *out, size_t len) {
+	out[0] = '\0';
+	while (*list != '\0') {
+		char *end;
+		long cpu = strtol(list, &end, 10);
+		if (end == list)
+			break;
+		if (cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, allowed))
+			append_cpu(out, len, cpu);
+		list = *end == ',' ? end + 1 : end;
+	}
+}
+
+int cputopo_class_lists(const cpu_set_t *allowed, char *fast, char *slow, size_t len) {
+	char *lists[2] = {fast, slow};
+	int first = -1;
+	for (int cpu = 0; cpu < CPU_SETSIZE && first == -1; cpu++)
+		if (CPU_ISSET(cpu, allowed))
+			first = cpu;
+	if (first == -1)
+		return -1;
+
+	char derived[2][256] = {"", ""};
+	int have_derived = 0;
+	for (int slow_class = 0; slow_class < 2; slow_class++) {
+		const char *env = getenv(slow_class ? "SLOW_CPU" : "FAST_CPU");
+		if (env != NULL && *env != '\0' && strcmp(env, "auto") != 0) {
+			filter_cpus(env, allowed, lists[slow_class], len);
+			continue;
+		}
+		if (!have_derived) {
+			have_derived = 1;
+			struct cputopo topo;
+			if (cputopo_load(&topo) == 0) {
+				// Drop the CPUs that are not allowed.
+				int n = 0;
+				for (int i = 0; i < topo.count; i++)
+					if (CPU_ISSET(topo.cpus[i].cpu, allowed))
+						topo.cpus[n++] = topo.cpus[i];
+				topo.count = n;
+				if (n == 0 || cputopo_classes(&topo, derived[0], derived[1], sizeof derived[0]) != 0)
+					derived[0][0] = derived[1][0] = '\0';
+			}
+			cputopo_free(&topo);
+		}
+		snprintf(lists[slow_class], len, "%s", derived[slow_class]);
+	}
+	// An empty class gets the lowest allowed CPU that the other class doesn't
+	// use, as two classes on one CPU would make migrations pointless.
+	for (int slow_class = 0; slow_class < 2; slow_class++) {
+		if (lists[slow_class][0] != '\0')
+			continue;
+		cpu_set_t other;
+		int cpu;
+		parse_cpu_list(lists[!slow_class], &other);
+		for (cpu = first; cpu < CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, allowed) && !CPU_ISSET(cpu, &other))
+				break;
+		if (cpu == CPU_SETSIZE)
+			return -1;
+		snprintf(lists[slow_class], len, "%d", cpu);
+	}
+	return 0;
+}
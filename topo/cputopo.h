@@ -0,0 +1,89 @@
+/*
+ * Copyright © 2018, Lukas Werling
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CPUTOPO_H
+#define CPUTOPO_H
+
+#include <sched.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// CPU model from sysfs and cpuid, used to derive the CPUs of the core classes
+// when FAST_CPU and SLOW_CPU are not set.
+struct cputopo_cpu {
+	int cpu;
+	// First CPU of the physical core (SMT siblings share it), of the L2 and
+	// of the L3 cache (the CCX on Ryzen). -1 if unknown.
+	int core, l2, l3;
+	int package, numa_node;
+	// APIC id from /dev/cpu/N/cpuid, -1 without access.
+	int apic_id;
+	// Position in the L3 cache PMC thread mask, see cputopo_probe_l3().
+	int l3_core, l3_thread;
+	// Frequencies in kHz, 0 if unknown.
+	unsigned max_khz, cur_khz;
+	// Relative performance, 1024 for the fastest CPU.
+	unsigned capacity;
+};
+
+struct cputopo {
+	int count;
+	struct cputopo_cpu *cpus;
+};
+
+// Reads the model of all online CPUs. Returns 0 on success.
+int cputopo_load(struct cputopo *topo);
+void cputopo_free(struct cputopo *topo);
+
+// Writes comma-separated CPU lists for the fast and slow core class. With CPUs
+// of different capacity, the classes are the fastest and the slowest CPUs, one
+// per physical core. Otherwise, they are two cores sharing an L3 cache, whose
+// frequency has to be set separately (e.g., with tools/amdpstate). Returns 0
+// on success.
+int cputopo_classes(const struct cputopo *topo, char *fast, char *slow, size_t len);
+
+// Returns $FAST_CPU (slow = 0) or $SLOW_CPU (slow = 1) if set, otherwise the
+// lists from cputopo_classes(). Returns NULL if neither works.
+const char *cputopo_class_cpus(int slow);
+// Derives the lists of cputopo_class_cpus() again on the next call, e.g.,
+// after CPUs went online or offline. Earlier results stay valid.
+void cputopo_invalidate_classes(void);
+
+// Returns the CPUs that are online and in the cpuset of the process's cgroup
+// (cgroup v2 or v1). They change with CPU hotplug and when a container
+// orchestrator resizes the cpuset. Returns 0 on success.
+int cputopo_allowed_cpus(cpu_set_t *allowed);
+
+// Like cputopo_class_cpus(), restricted to the allowed CPUs: lists from
+// FAST_CPU and SLOW_CPU are filtered, otherwise the classes are derived from
+// the allowed part of the topology. A class without allowed CPUs gets the
+// lowest allowed CPU outside the other class. Returns 0 on success, -1 if no
+// such CPU is left.
+int cputopo_class_lists(const cpu_set_t *allowed, char *fast, char *slow, size_t len);
+
+// Refines l3_core and l3_thread by causing L3 cache misses on each CPU and
+// watching the Ryzen L3 PMCs. Needs /dev/cpu/N/msr and changes the calling
+// thread's affinity. Implemented in cputopo_pmc.c, which needs pmc/pmc.c.
+void cputopo_probe_l3(struct cputopo *topo);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
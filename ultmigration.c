@@ -15,40 +15,89 @@
  */
 #define _GNU_SOURCE
 
-#include "ultmigration.h"
+#include "ultmigration_backend.h"
+#include "topo/cputopo.h"
 
 #include <assert.h>
 #include <pthread.h>
 #include <malloc.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sched.h>
-#include <semaphore.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 /* global initialization */
 
+/* References to the thread pool by registered threads, ult_pool_ref() and
+ * ult_init(). The pool threads run while the count is nonzero. Changes from or
+ * to zero happen with init_mutex held, all others are lock-free. */
 static int klt_count = 0;
-static int initialized = 0;
+/* set by ult_init(), which holds a reference until ult_deinit() */
+static int persistent = 0;
 pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 // Bits 7:4 specify the C-State.
 static const uint32_t MWAIT_CSTATE = 0x00;
+// Set by the futex backend: idle pool threads sleep on a futex instead of
+// waiting with monitor/mwait, for kernels that don't allow mwait in user space.
+static int idle_futex = 0;
+
+// A queued ULT is picked at the latest after being passed over this many times
+// in favor of ULTs with higher benefit.
+static unsigned max_skips = 8;
+// Number of ULTs that may wait for a busy pool thread in ult_migrate_benefit()
+// before it falls back to staying on the current core. Arbitration needs
+// several waiting ULTs to choose from; with a single one, the slot would go
+// to whichever ULT arrives first. Queued entries are only removed by their
+// pool thread, so a late ULT with a higher benefit can't displace one that
+// already waits, but it overtakes it as long as there is room in the queue.
+static unsigned max_waiting = 4;
 
 
 struct thread_pool_info;
 
+/* arbitration state of queue entries, written by the ULT before it enqueues
+ * itself and by the picking pool thread */
+struct ult_sched {
+	double benefit;
+	unsigned skips;
+};
+
 /* current ULT */
 struct current_thread_info {
 	struct thread_pool_info *pool_thread;
 	uintptr_t stack;
-	char aux_thread[4096];
-	sem_t exit_sem;
+	/* stack of the original kernel-level thread while the ULT runs on the
+	 * pool. Signals delivered to the thread use it as well, and their frames
+	 * alone can exceed 4 KiB with AVX-512 state. ult_register_asm depends on
+	 * its size. */
+	char aux_thread[65536];
+	/* futex set when the ULT returns to its original kernel-level thread.
+	 * Not a semaphore, so that ultmigration_blocking.c does not wrap the
+	 * waits. */
+	int exit_flag;
+	struct ult_sched sched;
+	/* set while the ULT is inside libultmigration, see
+	 * ult_migrate_from_signal() */
+	int busy;
+	/* nesting depth of ult_blocking_begin() and the type of core to return
+	 * to, the ULT runs on its original kernel-level thread meanwhile */
+	unsigned blocking;
+	enum ult_thread_type blocking_type;
+	/* fs base of the ULT's own TLS, see pool_migrate_from_signal() */
+	uintptr_t fsbase;
 };
 static __thread struct current_thread_info *current;
 
 /* thread pool for ULT execution */
 
-#define THREAD_POOL_SIZE 1
+/* maximum number of pool threads per type, one for each CPU in FAST_CPU or
+ * SLOW_CPU */
+#define MAX_POOL_SIZE 16
 
 #define STOP_THREAD ((void*)(uintptr_t)(-1))
 
@@ -57,11 +106,82 @@ struct thread_pool_info {
 	uintptr_t stack;
 	pthread_t thread;
 	int cpu;
+	pid_t tid;
+	uintptr_t fsbase;
+	enum ult_thread_type type;
+	/* ULT executing on this thread, NULL while idle */
+	struct current_thread_info *running;
+	/* set by ult_resize_pool() when the CPU left the class. The thread
+	 * still runs the ULTs it has, but ult_select() skips it. */
+	int retired;
+	/* futex set while the pool thread sleeps with the futex backend */
+	int sleeping;
 } __attribute__((aligned(64)));
 
+/* offloaded function, see ult_offload(). Tasks share the ready queues with
+ * ULTs and are marked by setting the lowest bit of the queue entry. */
+struct ult_task {
+	void (*fn)(void *);
+	void *arg;
+	struct ult_sched sched;
+	/* NULL while running, TASK_DONE when finished, or the parked ULT
+	 * waiting for the task */
+	struct current_thread_info *state;
+};
+
+#define TASK_TAG ((uintptr_t) 1)
+#define TASK_DONE ((struct current_thread_info *)(uintptr_t) 1)
+
+static inline int ult_is_task(struct current_thread_info *entry) {
+	return (uintptr_t) entry & TASK_TAG;
+}
+
+static inline struct ult_task *ult_untag_task(struct current_thread_info *entry) {
+	return (struct ult_task *)((uintptr_t) entry & ~TASK_TAG);
+}
+
+static inline struct ult_sched *ult_entry_sched(struct current_thread_info *entry) {
+	return ult_is_task(entry) ? &ult_untag_task(entry)->sched : &entry->sched;
+}
+
 // We have ULT_TYPE_MAX types of threads. For each type, there is a pool of
-// THREAD_POOL_SIZE threads.
-static struct thread_pool_info pool[ULT_TYPE_MAX][THREAD_POOL_SIZE];
+// pool_size[type] threads. The pools only grow while running, see
+// ult_resize_pool().
+static struct thread_pool_info pool[ULT_TYPE_MAX][MAX_POOL_SIZE];
+static int pool_size[ULT_TYPE_MAX];
+// Cost of a pool thread that is busy or has a ULT waiting, in units of the
+// migration cost.
+/* migration costs between the pool threads, see ult_load_costs() */
+struct ult_costs {
+	double cost[ULT_TYPE_MAX][MAX_POOL_SIZE][ULT_TYPE_MAX][MAX_POOL_SIZE];
+	/* cost of each ULT a destination is busy with */
+	double busy;
+	/* table this one replaced, freed by ult_uninitialize() */
+	struct ult_costs *previous;
+};
+static struct ult_costs *costs;
+
+/* work run by pool threads while their ready queue is empty. Unlike the ready
+ * queues, the lists are unbounded, so pool threads can post work to each
+ * other without blocking. */
+struct ult_work {
+	union {
+		void (*post)(void *);
+		int (*background)(void *);
+	} fn;
+	void *arg;
+	struct ult_work *next;
+};
+struct ult_work_list {
+	int lock;
+	struct ult_work *head, *tail;
+};
+/* see ult_post() */
+static struct ult_work_list posted[ULT_TYPE_MAX];
+/* low-priority work, see ult_background() */
+static struct ult_work_list background[ULT_TYPE_MAX];
+/* pool thread running a background task, in the pool thread's TLS */
+static __thread struct thread_pool_info *background_pool;
 
 static inline void __monitor(const void *address)
 {
@@ -77,42 +197,260 @@ static inline void __mwait(uint32_t cstate)
 	               :: "a" (cstate), "c" (0));
 }
 
-struct current_thread_info *ult_pick_next_thread(struct thread_pool_info *pool_thread) {
-	struct current_thread_info *next = NULL;
+/* Returns the queue index of the ULT with the highest benefit, or -1 if the
+ * queue is empty. ULTs that were skipped max_skips times win regardless of
+ * their benefit. */
+static int ult_arbitrate(struct current_thread_info **queue) {
+	int i, best = -1;
+	for (i = 0; i < 8; i++) {
+		if (!queue[i]) {
+			continue;
+		}
+		if (ult_entry_sched(queue[i])->skips >= max_skips) {
+			return i;
+		}
+		if (best == -1 || ult_entry_sched(queue[i])->benefit >
+		                  ult_entry_sched(queue[best])->benefit) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+/* futex system call without the libc wrapper, which writes errno on failure.
+ * The callers may run with fs still pointing to the TLS of a ULT that is
+ * migrating or has left, and whose thread may already have exited. */
+static inline long ult_futex(int *uaddr, int op, int val) {
+	long ret;
+	register void *timeout __asm("r10") = NULL;
+	__asm volatile("syscall"
+	               : "=a" (ret)
+	               : "0" ((long) SYS_futex), "D" (uaddr), "S" ((long) op),
+	                 "d" ((long) val), "r" (timeout)
+	               : "rcx", "r11", "memory");
+	return ret;
+}
+
+/* called after inserting into the ready queue of a pool thread, wakes it if it
+ * sleeps on its futex */
+void ult_notify(struct thread_pool_info *pool_thread) {
+	if (!idle_futex) {
+		return;
+	}
+	if (__atomic_load_n(&pool_thread->sleeping, __ATOMIC_SEQ_CST) &&
+	    __atomic_exchange_n(&pool_thread->sleeping, 0, __ATOMIC_SEQ_CST)) {
+		ult_futex(&pool_thread->sleeping, FUTEX_WAKE_PRIVATE, 1);
+	}
+}
+
+/* inserts a ULT or tagged task into the ready queue of a pool thread, like
+ * the assembly code does */
+static void ult_enqueue(struct thread_pool_info *pool_thread,
+                        struct current_thread_info *entry) {
+	int i = 0;
+	while (1) {
+		struct current_thread_info *expected = NULL;
+		if (__atomic_compare_exchange_n(&pool_thread->queue[i], &expected,
+		                                entry, 0, __ATOMIC_SEQ_CST,
+		                                __ATOMIC_RELAXED)) {
+			ult_notify(pool_thread);
+			return;
+		}
+		i = (i + 1) % 8;
+	}
+}
+
+/* idle pool threads still have the fs base of the last ULT, but tasks have
+ * to use the pool thread's TLS */
+static inline void ult_use_pool_tls(struct thread_pool_info *pool_thread) {
+	__asm volatile("wrfsbase %0" :: "r" (pool_thread->fsbase) : "memory");
+}
+
+static void ult_run_task(struct thread_pool_info *pool_thread,
+                         struct ult_task *task) {
+	ult_use_pool_tls(pool_thread);
+	task->fn(task->arg);
+	struct current_thread_info *waiter =
+		__atomic_exchange_n(&task->state, TASK_DONE, __ATOMIC_SEQ_CST);
+	if (waiter != NULL) {
+		/* resume the parked ULT where it was running before */
+		ult_enqueue(waiter->pool_thread, waiter);
+	}
+}
+
+static void ult_work_push(struct ult_work_list *list, struct ult_work *work) {
+	work->next = NULL;
+	while (__atomic_exchange_n(&list->lock, 1, __ATOMIC_ACQUIRE)) {
+		sched_yield();
+	}
+	if (list->tail != NULL) {
+		list->tail->next = work;
+	} else {
+		list->head = work;
+	}
+	list->tail = work;
+	__atomic_store_n(&list->lock, 0, __ATOMIC_RELEASE);
+}
+
+static struct ult_work *ult_work_pop(struct ult_work_list *list) {
+	struct ult_work *work;
+	if (__atomic_load_n(&list->head, __ATOMIC_RELAXED) == NULL) {
+		return NULL;
+	}
+	while (__atomic_exchange_n(&list->lock, 1, __ATOMIC_ACQUIRE)) {
+		sched_yield();
+	}
+	work = list->head;
+	if (work != NULL) {
+		list->head = work->next;
+		if (list->head == NULL) {
+			list->tail = NULL;
+		}
+	}
+	__atomic_store_n(&list->lock, 0, __ATOMIC_RELEASE);
+	return work;
+}
+
+static int ult_work_pending(struct thread_pool_info *pool_thread) {
+	return __atomic_load_n(&posted[pool_thread->type].head, __ATOMIC_SEQ_CST) ||
+	       __atomic_load_n(&background[pool_thread->type].head, __ATOMIC_SEQ_CST);
+}
+
+/* wakes up a pool thread waiting in mwait: an atomic no-op write to the
+ * monitored cache line does not disturb enqueues */
+static void ult_wake(struct thread_pool_info *pool_thread) {
+	__atomic_fetch_or((uintptr_t *) &pool_thread->queue[0], 0,
+	                  __ATOMIC_SEQ_CST);
+	ult_notify(pool_thread);
+}
+
+static void ult_wake_all(enum ult_thread_type type) {
+	int i;
+	int size = __atomic_load_n(&pool_size[type], __ATOMIC_ACQUIRE);
+	for (i = 0; i < size; i++) {
+		ult_wake(&pool[type][i]);
+	}
+}
+
+/* must not be inlined into ult_pick_next_thread so that the TLS address is
+ * computed after switching to the pool thread's TLS */
+static __attribute__((noinline))
+int ult_background_call(struct thread_pool_info *pool_thread,
+                        struct ult_work *work) {
+	int again;
+	background_pool = pool_thread;
+	again = work->fn.background(work->arg);
+	background_pool = NULL;
+	return again;
+}
+
+/* runs one posted or background work item, returns 0 if there was none */
+static int ult_run_work(struct thread_pool_info *pool_thread) {
+	int type = pool_thread->type;
+	struct ult_work *work;
+
+	if ((work = ult_work_pop(&posted[type])) != NULL) {
+		ult_use_pool_tls(pool_thread);
+		work->fn.post(work->arg);
+		free(work);
+		return 1;
+	}
+	if ((work = ult_work_pop(&background[type])) != NULL) {
+		ult_use_pool_tls(pool_thread);
+		if (ult_background_call(pool_thread, work)) {
+			/* the work yielded with work left, continue later */
+			ult_work_push(&background[type], work);
+		} else {
+			free(work);
+		}
+		return 1;
+	}
+	return 0;
+}
+
+/* sleeps until ult_notify() unless there is something to run */
+static void ult_futex_sleep(struct thread_pool_info *pool_thread) {
 	int i;
+	__atomic_store_n(&pool_thread->sleeping, 1, __ATOMIC_SEQ_CST);
+	for (i = 0; i < 8; i++) {
+		if (__atomic_load_n(&pool_thread->queue[i], __ATOMIC_SEQ_CST) != NULL) {
+			goto awake;
+		}
+	}
+	if (!ult_work_pending(pool_thread)) {
+		ult_futex(&pool_thread->sleeping, FUTEX_WAIT_PRIVATE, 1);
+	}
+awake:
+	__atomic_store_n(&pool_thread->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+struct current_thread_info *ult_pick_next_thread(struct thread_pool_info *pool_thread) {
+	struct current_thread_info *queue[8];
+	struct current_thread_info *next;
+	int i, best;
+
+	__atomic_store_n(&pool_thread->running, NULL, __ATOMIC_RELAXED);
 
 	/* poll until a ULT is scheduled to run on this thread */
 	while (1) {
 mwait_retry:
-		/* check all the queue entries for a non-null entry */
+		/* take a snapshot of the queue, entries are only removed by
+		 * this thread */
 		for (i = 0; i < 8; i++) {
-			/*next = __atomic_exchange_n(&pool_thread->queue[i],
-			                           next,
-			                           __ATOMIC_SEQ_CST);*/
-			next = __atomic_load_n(&pool_thread->queue[i],
-			                       __ATOMIC_SEQ_CST);
-			if (next) {
-				/* does not need to be atomic, we are the only
-				 * writer */
-				__atomic_store_n(&pool_thread->queue[i],
-				                 NULL,
-				                 __ATOMIC_SEQ_CST);
-				return next;
+			queue[i] = __atomic_load_n(&pool_thread->queue[i],
+			                           __ATOMIC_SEQ_CST);
+			if (queue[i] == STOP_THREAD) {
+				return STOP_THREAD;
+			}
+		}
+		best = ult_arbitrate(queue);
+		if (best != -1) {
+			next = queue[best];
+			/* does not need to be atomic, we are the only
+			 * writer */
+			__atomic_store_n(&pool_thread->queue[best],
+			                 NULL,
+			                 __ATOMIC_SEQ_CST);
+			for (i = 0; i < 8; i++) {
+				if (i != best && queue[i]) {
+					ult_entry_sched(queue[i])->skips++;
+				}
 			}
+			ult_entry_sched(next)->skips = 0;
+			__atomic_store_n(&pool_thread->running, next, __ATOMIC_RELAXED);
+			if (ult_is_task(next)) {
+				ult_run_task(pool_thread, ult_untag_task(next));
+				__atomic_store_n(&pool_thread->running, NULL, __ATOMIC_RELAXED);
+				continue;
+			}
+			return next;
+		}
+		/* if none was found, run posted and background work */
+		if (ult_run_work(pool_thread)) {
+			continue;
 		}
-		/* if none was found, sleep until the cache line changes */
+		if (idle_futex) {
+			ult_futex_sleep(pool_thread);
+			continue;
+		}
+		/* otherwise sleep until the cache line changes */
 		__monitor(pool_thread->queue);
 		for (i = 0; i < 8; i++) {
 			if (pool_thread->queue[i] != NULL) {
 				goto mwait_retry;
 			}
 		}
+		if (ult_work_pending(pool_thread)) {
+			continue;
+		}
 		__mwait(MWAIT_CSTATE);
 		/* try again */
 	}
 }
 
 void ult_set_pool_thread_affinity(struct thread_pool_info *pool_thread) {
+	__atomic_store_n(&pool_thread->tid, syscall(SYS_gettid), __ATOMIC_RELAXED);
+	__asm volatile("rdfsbase %0" : "=r" (pool_thread->fsbase));
 	cpu_set_t cpus;
 	CPU_ZERO(&cpus);
 	CPU_SET(pool_thread->cpu, &cpus);
@@ -121,75 +459,501 @@ void ult_set_pool_thread_affinity(struct thread_pool_info *pool_thread) {
 
 extern void *ult_pool_thread_entry(void *param);
 
-static void ult_initialize(void) {
-	int i, t;
-	char *cpu_list, *end;
+/* The flag only has to be ordered with respect to signal handlers running on
+ * the same ULT. */
+static inline void ult_set_busy(struct current_thread_info *ult, int busy) {
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	ult->busy = busy;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
 
-	/* analyze the processor topology */
-	char *slow_cpu = getenv("SLOW_CPU");
-	char *fast_cpu = getenv("FAST_CPU");
-	assert(slow_cpu != NULL && fast_cpu != NULL && "SLOW_CPU or FAST_CPU environment variable not set");
+/* Returns an id of the L3 cache of a CPU, the lowest CPU sharing it, or -1 if
+ * unknown. */
+static int ult_l3_id(int cpu) {
+	char path[128];
+	int id = -1;
+	snprintf(path, sizeof(path),
+	         "/sys/devices/system/cpu/cpu%d/cache/index3/shared_cpu_list", cpu);
+	FILE *f = fopen(path, "r");
+	if (f != NULL) {
+		if (fscanf(f, "%d", &id) != 1) {
+			id = -1;
+		}
+		fclose(f);
+	}
+	return id;
+}
+
+/* Publishes a new cost table. ult_select() may still read the old one, so it
+ * stays allocated until ult_uninitialize(). */
+static void ult_store_costs(struct ult_costs *table, double busy) {
+	table->busy = busy;
+	table->previous = costs;
+	__atomic_store_n(&costs, table, __ATOMIC_RELEASE);
+}
+
+/* Fills the migration costs between the pool threads. ULT_COST_MATRIX names a
+ * file written by tools/migcost with lines "FROM TO ROUNDTRIP_NS REFILL_NS".
+ * CPU pairs missing from it get the highest cost in the file. Without a
+ * matrix, migrations within an L3 cache cost 0 and all others 1. The costs
+ * go to a new table that replaces the current one in a single pointer store,
+ * so ult_select() never sees a partially updated table while
+ * ult_reconfigure() runs. */
+static void ult_load_costs(void) {
+	int t, i, u, j;
+	double max_cost = 1;
+	struct ult_costs *table = calloc(1, sizeof(*table));
+	double (*cost)[MAX_POOL_SIZE][ULT_TYPE_MAX][MAX_POOL_SIZE] = table->cost;
 
-	/* create a thread pool */
 	for (t = 0; t < ULT_TYPE_MAX; t++) {
-		switch (t) {
-			case ULT_FAST: cpu_list = fast_cpu; break;
-			case ULT_SLOW: cpu_list = slow_cpu; break;
+		for (i = 0; i < pool_size[t]; i++) {
+			int l3 = ult_l3_id(pool[t][i].cpu);
+			for (u = 0; u < ULT_TYPE_MAX; u++) {
+				for (j = 0; j < pool_size[u]; j++) {
+					int other = ult_l3_id(pool[u][j].cpu);
+					cost[t][i][u][j] =
+						l3 != -1 && l3 == other ? 0 : 1;
+				}
+			}
 		}
-		for (i = 0; i < THREAD_POOL_SIZE; i++) {
-			// Read cpu_list as list of comma-separated integers.
-			pool[t][i].cpu = strtol(cpu_list, &end, 10);
-			assert(end != cpu_list && "SLOW_CPU/FAST_CPU contained invalid data");
-			cpu_list = end;
-			if (*cpu_list == ',') cpu_list++;
+	}
 
-			pthread_create(&pool[t][i].thread,
-				       NULL,
-				       ult_pool_thread_entry,
-				       &pool[t][i]);
+	char *path = getenv("ULT_COST_MATRIX");
+	if (path == NULL || *path == '\0') {
+		ult_store_costs(table, 1);
+		return;
+	}
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "ultmigration: ULT_COST_MATRIX=%s\n", path);
+		perror("ultmigration: couldn't open $ULT_COST_MATRIX");
+		exit(-1);
+	}
+	for (t = 0; t < ULT_TYPE_MAX; t++) {
+		for (i = 0; i < pool_size[t]; i++) {
+			for (u = 0; u < ULT_TYPE_MAX; u++) {
+				for (j = 0; j < pool_size[u]; j++) {
+					cost[t][i][u][j] =
+						pool[t][i].cpu == pool[u][j].cpu ? 0 : -1;
+				}
+			}
+		}
+	}
+	char line[256];
+	int from, to;
+	double roundtrip, refill;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (line[0] == '#' ||
+		    sscanf(line, "%d %d %lf %lf", &from, &to, &roundtrip, &refill) != 4) {
+			continue;
+		}
+		double pair_cost = roundtrip / 2 + (refill > 0 ? refill : 0);
+		if (pair_cost > max_cost) {
+			max_cost = pair_cost;
+		}
+		for (t = 0; t < ULT_TYPE_MAX; t++) {
+			for (i = 0; i < pool_size[t]; i++) {
+				if (pool[t][i].cpu != from) {
+					continue;
+				}
+				for (u = 0; u < ULT_TYPE_MAX; u++) {
+					for (j = 0; j < pool_size[u]; j++) {
+						if (pool[u][j].cpu == to) {
+							cost[t][i][u][j] = pair_cost;
+						}
+					}
+				}
+			}
+		}
+	}
+	fclose(f);
+	for (t = 0; t < ULT_TYPE_MAX; t++) {
+		for (i = 0; i < pool_size[t]; i++) {
+			for (u = 0; u < ULT_TYPE_MAX; u++) {
+				for (j = 0; j < pool_size[u]; j++) {
+					if (cost[t][i][u][j] < 0) {
+						cost[t][i][u][j] = max_cost;
+					}
+				}
+			}
+		}
+	}
+	/* a busy destination is as bad as the most expensive migration */
+	ult_store_costs(table, max_cost);
+}
+
+/* Reads a comma-separated list of CPUs, at most MAX_POOL_SIZE. */
+static int ult_parse_cpus(const char *cpu_list, int *cpus) {
+	int i;
+	char *end;
+	for (i = 0; i < MAX_POOL_SIZE && *cpu_list != '\0'; i++) {
+		cpus[i] = strtol(cpu_list, &end, 10);
+		assert(end != cpu_list && "SLOW_CPU/FAST_CPU contained invalid data");
+		cpu_list = end;
+		if (*cpu_list == ',') cpu_list++;
+	}
+	return i;
+}
+
+static void ult_start_pool_thread(struct thread_pool_info *pool_thread,
+                                  enum ult_thread_type type, int cpu) {
+	pool_thread->cpu = cpu;
+	pool_thread->type = type;
+	pool_thread->retired = 0;
+	pthread_create(&pool_thread->thread,
+	               NULL,
+	               ult_pool_thread_entry,
+	               pool_thread);
+}
+
+/* runtime reconfiguration, see ult_reconfigure() */
+
+/* period of the cpuset and hotplug checks in ms, 0 disables them */
+static unsigned reconfig_ms = 1000;
+static pthread_t monitor_thread;
+static int monitor_running = 0;
+static int monitor_stop;
+static pthread_mutex_t monitor_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t monitor_cond = PTHREAD_COND_INITIALIZER;
+/* allowed CPUs that the current classes were built from, empty if unknown */
+static cpu_set_t monitor_allowed;
+
+static void ult_pin_pool_thread(struct thread_pool_info *pool_thread,
+                                const cpu_set_t *cpus) {
+	pthread_setaffinity_np(pool_thread->thread, sizeof(*cpus), cpus);
+}
+
+/* Moves the pool threads of a type to new CPUs. Pool threads on CPUs that
+ * remain in the class stay there, the others move to the new CPUs. If there
+ * are more CPUs than pool threads, new pool threads start. Pool threads left
+ * over retire: they may run on any CPU of the class and finish the ULTs they
+ * have, but ult_select() no longer picks them. Pool threads never stop before
+ * ult_uninitialize(), as ULTs hold pointers to them. */
+static void ult_resize_pool(enum ult_thread_type type, const int *cpus, int count) {
+	int keep[MAX_POOL_SIZE] = {0}, placed[MAX_POOL_SIZE] = {0};
+	int i, j, size = pool_size[type];
+	cpu_set_t class_cpus, cpu;
+
+	CPU_ZERO(&class_cpus);
+	for (j = 0; j < count; j++) {
+		CPU_SET(cpus[j], &class_cpus);
+		for (i = 0; i < size; i++) {
+			if (!keep[i] && pool[type][i].cpu == cpus[j]) {
+				keep[i] = placed[j] = 1;
+				break;
+			}
+		}
+	}
+	for (j = 0; j < count; j++) {
+		if (placed[j]) {
+			continue;
+		}
+		for (i = 0; i < size && keep[i]; i++);
+		if (i < size) {
+			keep[i] = 1;
+			pool[type][i].cpu = cpus[j];
+		} else if (size < MAX_POOL_SIZE) {
+			keep[size] = 1;
+			ult_start_pool_thread(&pool[type][size], type, cpus[j]);
+			size++;
+		}
+	}
+	for (i = 0; i < size; i++) {
+		if (keep[i]) {
+			CPU_ZERO(&cpu);
+			CPU_SET(pool[type][i].cpu, &cpu);
+			ult_pin_pool_thread(&pool[type][i], &cpu);
+		} else {
+			ult_pin_pool_thread(&pool[type][i], &class_cpus);
+		}
+		__atomic_store_n(&pool[type][i].retired, !keep[i], __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&pool_size[type], size, __ATOMIC_RELEASE);
+}
+
+/* Rebuilds the core classes after the allowed CPUs changed, e.g., because a
+ * CPU went offline or the cgroup cpuset was resized. Queued ULTs stay with
+ * their pool threads. */
+static void ult_reconfigure(const cpu_set_t *allowed) {
+	char lists[ULT_TYPE_MAX][256];
+	int cpus[MAX_POOL_SIZE], t;
+
+	/* later cputopo_class_cpus() calls, e.g., by the affinity backend, see
+	 * the new topology */
+	cputopo_invalidate_classes();
+	if (cputopo_class_lists(allowed, lists[ULT_FAST], lists[ULT_SLOW],
+	                        sizeof(lists[0])) != 0) {
+		fprintf(stderr, "ultmigration: no separate CPUs for both core classes, keeping the current ones\n");
+		return;
+	}
+	for (t = 0; t < ULT_TYPE_MAX; t++) {
+		ult_resize_pool(t, cpus, ult_parse_cpus(lists[t], cpus));
+	}
+	ult_load_costs();
+}
+
+/* Keeps the monitor thread off the CPUs of the pool threads, so that the
+ * checks don't interrupt ULTs. It stays unpinned if no other CPU is allowed. */
+static void ult_pin_monitor(const cpu_set_t *allowed) {
+	cpu_set_t cpus = *allowed;
+	int t, i;
+	for (t = 0; t < ULT_TYPE_MAX; t++) {
+		for (i = 0; i < pool_size[t]; i++) {
+			CPU_CLR(pool[t][i].cpu, &cpus);
+		}
+	}
+	if (CPU_COUNT(&cpus) > 0) {
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+}
+
+static void *ult_monitor_main(void *arg) {
+	cpu_set_t allowed, last = monitor_allowed;
+	struct timespec deadline;
+	(void) arg;
+
+	/* without a snapshot from ult_initialize(), the first check applies the
+	 * cpuset to the initial configuration */
+	if (CPU_COUNT(&last) > 0) {
+		ult_pin_monitor(&last);
+	}
+	pthread_mutex_lock(&monitor_mutex);
+	while (!monitor_stop) {
+		if (cputopo_allowed_cpus(&allowed) == 0 && !CPU_EQUAL(&allowed, &last)) {
+			last = allowed;
+			ult_reconfigure(&allowed);
+			ult_pin_monitor(&allowed);
+		}
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += reconfig_ms / 1000;
+		deadline.tv_nsec += (long) (reconfig_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
 		}
+		pthread_cond_timedwait(&monitor_cond, &monitor_mutex, &deadline);
+	}
+	pthread_mutex_unlock(&monitor_mutex);
+	return NULL;
+}
+
+static void ult_initialize(void) {
+	int i, t, cpus[MAX_POOL_SIZE];
+	char lists[ULT_TYPE_MAX][256];
+
+	char *env = getenv("ULT_MAX_SKIPS");
+	if (env != NULL) {
+		max_skips = atoi(env);
+	}
+	env = getenv("ULT_MAX_WAITING");
+	if (env != NULL) {
+		max_waiting = atoi(env);
+	}
+	env = getenv("ULT_RECONFIG_MS");
+	if (env != NULL) {
+		reconfig_ms = atoi(env);
+	}
+
+	/* analyze the processor topology, FAST_CPU and SLOW_CPU override it. With
+	 * the monitor, the classes start out restricted to the allowed CPUs, and
+	 * the monitor only reconfigures when they change. */
+	const char *slow_cpu = cputopo_class_cpus(1);
+	const char *fast_cpu = cputopo_class_cpus(0);
+	CPU_ZERO(&monitor_allowed);
+	if (reconfig_ms > 0 && cputopo_allowed_cpus(&monitor_allowed) == 0 &&
+	    cputopo_class_lists(&monitor_allowed, lists[ULT_FAST], lists[ULT_SLOW],
+	                        sizeof(lists[0])) == 0) {
+		fast_cpu = lists[ULT_FAST];
+		slow_cpu = lists[ULT_SLOW];
+	} else {
+		CPU_ZERO(&monitor_allowed);
+	}
+	if (slow_cpu == NULL || fast_cpu == NULL) {
+		fprintf(stderr, "ultmigration: set FAST_CPU and SLOW_CPU, no core classes found in the CPU topology\n");
+		exit(-1);
+	}
+
+	/* create a thread pool with one pool thread per CPU */
+	for (t = 0; t < ULT_TYPE_MAX; t++) {
+		pool_size[t] = ult_parse_cpus(t == ULT_FAST ? fast_cpu : slow_cpu, cpus);
+		for (i = 0; i < pool_size[t]; i++) {
+			pool[t][i].cpu = cpus[i];
+		}
+	}
+	ult_load_costs();
+	for (t = 0; t < ULT_TYPE_MAX; t++) {
+		for (i = 0; i < pool_size[t]; i++) {
+			ult_start_pool_thread(&pool[t][i], t, pool[t][i].cpu);
+		}
+	}
+
+	if (reconfig_ms > 0) {
+		monitor_stop = 0;
+		monitor_running = pthread_create(&monitor_thread, NULL,
+		                                 ult_monitor_main, NULL) == 0;
 	}
 }
 
 static void ult_uninitialize(void) {
-	/* this function is only called when the last ULT calls
-	 * ult_unregister_klt, so we do not have to care about existing ready
-	 * queue contents */
+	/* this function is only called when the last reference is dropped,
+	 * i.e., no ULT is registered anymore, so we do not have to care about
+	 * existing ready queue contents */
 
 	int i, t;
 
+	/* the pools must not change while they stop */
+	if (monitor_running) {
+		pthread_mutex_lock(&monitor_mutex);
+		monitor_stop = 1;
+		pthread_cond_signal(&monitor_cond);
+		pthread_mutex_unlock(&monitor_mutex);
+		pthread_join(monitor_thread, NULL);
+		monitor_running = 0;
+	}
+
 	/* send the threads a message and wait for them to stop */
 	for (t = 0; t < ULT_TYPE_MAX; t++) {
-		for (i = 0; i < THREAD_POOL_SIZE; i++) {
+		for (i = 0; i < pool_size[t]; i++) {
 			__atomic_store_n(&pool[t][i].queue[0],
 					 STOP_THREAD,
 					 __ATOMIC_SEQ_CST);
+			ult_notify(&pool[t][i]);
 		}
 	}
 	for (t = 0; t < ULT_TYPE_MAX; t++) {
-		for (i = 0; i < THREAD_POOL_SIZE; i++) {
+		for (i = 0; i < pool_size[t]; i++) {
 			pthread_join(pool[t][i].thread, NULL);
+			/* ult_initialize() may start the pool again */
+			pool[t][i].queue[0] = NULL;
+			__atomic_store_n(&pool[t][i].tid, 0, __ATOMIC_RELAXED);
 		}
 	}
+	/* no ULT is left to read the cost tables */
+	while (costs != NULL) {
+		struct ult_costs *previous = costs->previous;
+		free(costs);
+		costs = previous;
+	}
 }
 
-void ult_register_asm(struct current_thread_info *thread,
-                      struct thread_pool_info *first_klt);
+/* must be called with init_mutex held */
+static void pool_ref_locked(void) {
+	if (__atomic_load_n(&klt_count, __ATOMIC_RELAXED) == 0) {
+		ult_initialize();
+	}
+	__atomic_add_fetch(&klt_count, 1, __ATOMIC_RELEASE);
+}
+
+static void pool_ref(void) {
+	/* fast path if the pool threads are already running */
+	int count = __atomic_load_n(&klt_count, __ATOMIC_RELAXED);
+	while (count > 0) {
+		if (__atomic_compare_exchange_n(&klt_count, &count, count + 1, 1,
+		                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			return;
+		}
+	}
+	pthread_mutex_lock(&init_mutex);
+	pool_ref_locked();
+	pthread_mutex_unlock(&init_mutex);
+}
 
-void ult_register_klt(void) {
+static void pool_unref(void) {
+	/* fast path if this is not the last reference */
+	int count = __atomic_load_n(&klt_count, __ATOMIC_RELAXED);
+	while (count > 1) {
+		if (__atomic_compare_exchange_n(&klt_count, &count, count - 1, 1,
+		                                __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			return;
+		}
+	}
 	pthread_mutex_lock(&init_mutex);
-	klt_count++;
-	if (!initialized) {
-		ult_initialize();
-		initialized = 1;
+	if (__atomic_sub_fetch(&klt_count, 1, __ATOMIC_ACQ_REL) == 0) {
+		ult_uninitialize();
 	}
 	pthread_mutex_unlock(&init_mutex);
+}
+
+static void pool_init(void) {
+	pthread_mutex_lock(&init_mutex);
+	if (!persistent) {
+		persistent = 1;
+		pool_ref_locked();
+	}
+	pthread_mutex_unlock(&init_mutex);
+}
+
+static void pool_deinit(void) {
+	pthread_mutex_lock(&init_mutex);
+	int was_persistent = persistent;
+	persistent = 0;
+	pthread_mutex_unlock(&init_mutex);
+	if (was_persistent) {
+		pool_unref();
+	}
+}
+
+/* Returns the number of ULTs waiting in the queue of a pool thread. */
+static unsigned ult_waiting(struct thread_pool_info *pool_thread) {
+	unsigned i, n = 0;
+	for (i = 0; i < 8; i++) {
+		if (__atomic_load_n(&pool_thread->queue[i], __ATOMIC_RELAXED)) {
+			n++;
+		}
+	}
+	return n;
+}
+
+/* Chooses the pool thread of the given type with the lowest migration cost
+ * from `from` (NULL for any) plus the cost of waiting for it. */
+static struct thread_pool_info *ult_select(enum ult_thread_type type,
+                                           struct thread_pool_info *from) {
+	struct thread_pool_info *best = &pool[type][0];
+	double best_cost = -1;
+	int i, size = __atomic_load_n(&pool_size[type], __ATOMIC_ACQUIRE);
+	if (size == 1 && !__atomic_load_n(&best->retired, __ATOMIC_RELAXED)) {
+		return best;
+	}
+	const struct ult_costs *table = __atomic_load_n(&costs, __ATOMIC_ACQUIRE);
+	const double *from_cost = from != NULL ?
+		table->cost[from->type][from - pool[from->type]][type] : NULL;
+	for (i = 0; i < size; i++) {
+		struct thread_pool_info *next = &pool[type][i];
+		if (__atomic_load_n(&next->retired, __ATOMIC_RELAXED)) {
+			continue;
+		}
+		double cost = from_cost != NULL ? from_cost[i] : 0;
+		unsigned load = ult_waiting(next) +
+			(__atomic_load_n(&next->running, __ATOMIC_RELAXED) != NULL);
+		cost += load * table->busy;
+		if (best_cost < 0 || cost < best_cost) {
+			best = next;
+			best_cost = cost;
+		}
+	}
+	return best;
+}
+
+/* Returns whether a ULT on the pool thread does not have to migrate to reach
+ * the type. ULTs on retired pool threads leave them with the next migration. */
+static inline int ult_on_class(struct thread_pool_info *pool_thread,
+                               enum ult_thread_type type) {
+	return pool_thread->type == type &&
+	       !__atomic_load_n(&pool_thread->retired, __ATOMIC_RELAXED);
+}
+
+void ult_register_asm(struct current_thread_info *thread,
+                      struct thread_pool_info *first_klt);
+
+static void pool_register_klt(void) {
+	pool_ref();
 
 	/* allocate a second stack for this kernel-level thread */
 	struct current_thread_info *thread =
 			malloc(sizeof(struct current_thread_info));
 	memset(thread, 0, sizeof(*thread));
-	sem_init(&thread->exit_sem, 0, 0);
+	__asm volatile("rdfsbase %0" : "=r" (thread->fsbase));
+	ult_set_busy(thread, 1);
 
 	/* store the pointer to the current thread in TLS so that it is always
 	 * directly available via %fs */
@@ -198,52 +962,300 @@ void ult_register_klt(void) {
 	/* migrate this user-level thread to the thread pool and let this
 	 * kernel-level thread block until ult_unregister_klt migrates the ULT
 	 * back */
-	ult_register_asm(current, &pool[0][0]);
+	ult_register_asm(current, ult_select(ULT_FAST, NULL));
+	ult_set_busy(current, 0);
 }
 
 void ult_wait_for_unregister(struct current_thread_info *thread) {
-	sem_wait(&thread->exit_sem);
+	while (!__atomic_exchange_n(&thread->exit_flag, 0, __ATOMIC_ACQUIRE)) {
+		ult_futex(&thread->exit_flag, FUTEX_WAIT_PRIVATE, 0);
+	}
 }
 
 void ult_signal_unregister(struct current_thread_info *thread) {
-	sem_post(&thread->exit_sem);
+	__atomic_store_n(&thread->exit_flag, 1, __ATOMIC_RELEASE);
+	ult_futex(&thread->exit_flag, FUTEX_WAKE_PRIVATE, 1);
 }
 
 void ult_unregister_asm(struct current_thread_info *thread);
 
-void ult_unregister_klt(void) {
+static void pool_unregister_klt(void) {
 	if (current == NULL) {
 		return;
 	}
-	/* migrate the thread to its original kernel-level thread */
-	ult_unregister_asm(current);
-
-	pthread_mutex_lock(&init_mutex);
-	klt_count--;
-	if (initialized && klt_count == 0) {
-		ult_uninitialize();
-		initialized = 0;
+	/* migrate the thread to its original kernel-level thread, unless it is
+	 * already there because of ult_blocking_begin() */
+	if (current->blocking == 0) {
+		ult_set_busy(current, 1);
+		ult_unregister_asm(current);
 	}
-	pthread_mutex_unlock(&init_mutex);
+	free(current);
+	current = NULL;
+	pool_unref();
 }
 
 void ult_migrate_asm(struct current_thread_info *ult,
                      struct thread_pool_info *next);
 
-void ult_migrate(enum ult_thread_type type) {
+static void pool_migrate(enum ult_thread_type type) {
 	assert(type >= 0 && type < ULT_TYPE_MAX);
 	if (current == NULL) {
 		return;
 	}
-	/* TODO: determine suitable threads in the thread pool for the phase */
-	// TODO: Use more than one thread?
-	struct thread_pool_info *next = &pool[type][0];
-	if (next == current->pool_thread) {
+	if (current->blocking) {
+		current->blocking_type = type;
+		return;
+	}
+	if (ult_on_class(current->pool_thread, type)) {
 		return;
 	}
+	struct thread_pool_info *next = ult_select(type, current->pool_thread);
+	current->sched.benefit = 0;
+	ult_set_busy(current, 1);
 	ult_migrate_asm(current, next);
+	ult_set_busy(current, 0);
 }
 
-int ult_registered(void) {
+static enum ult_thread_type pool_migrate_benefit(enum ult_thread_type type, double benefit) {
+	assert(type >= 0 && type < ULT_TYPE_MAX);
+	if (current == NULL) {
+		return type;
+	}
+	if (current->blocking) {
+		current->blocking_type = type;
+		return type;
+	}
+	if (ult_on_class(current->pool_thread, type)) {
+		return type;
+	}
+	struct thread_pool_info *next = ult_select(type, current->pool_thread);
+	/* waiting for a saturated pool thread is worse than continuing on the
+	 * current core */
+	if (__atomic_load_n(&next->running, __ATOMIC_RELAXED) != NULL &&
+	    ult_waiting(next) >= max_waiting) {
+		return current->pool_thread->type;
+	}
+	current->sched.benefit = benefit;
+	ult_set_busy(current, 1);
+	ult_migrate_asm(current, next);
+	ult_set_busy(current, 0);
+	return type;
+}
+
+/* Returns the pool thread running on this kernel-level thread, or NULL. */
+static struct thread_pool_info *ult_find_pool_thread(pid_t tid) {
+	int t, i;
+	for (t = 0; t < ULT_TYPE_MAX; t++) {
+		int size = __atomic_load_n(&pool_size[t], __ATOMIC_ACQUIRE);
+		for (i = 0; i < size; i++) {
+			if (pool[t][i].tid == tid) {
+				return &pool[t][i];
+			}
+		}
+	}
+	return NULL;
+}
+
+static int pool_migrate_from_signal(enum ult_thread_type type) {
+	/* pool threads keep the fs base of the last ULT while idle, and its TLS
+	 * may already be freed. So this must not touch any TLS before it knows
+	 * that the pool thread runs a ULT with the current fs base. */
+	struct thread_pool_info *pool_thread = ult_find_pool_thread(syscall(SYS_gettid));
+	if (pool_thread == NULL) {
+		return 0;
+	}
+	struct current_thread_info *ult =
+		__atomic_load_n(&pool_thread->running, __ATOMIC_RELAXED);
+	uintptr_t fsbase;
+	__asm volatile("rdfsbase %0" : "=r" (fsbase));
+	if (ult == NULL || ult_is_task(ult) || ult->fsbase != fsbase ||
+	    ult->busy || ult->pool_thread != pool_thread) {
+		return 0;
+	}
+	if (ult_on_class(ult->pool_thread, type)) {
+		return 1;
+	}
+	struct thread_pool_info *next = ult_select(type, ult->pool_thread);
+	ult->sched.benefit = 0;
+	ult_set_busy(ult, 1);
+	ult_migrate_asm(ult, next);
+	ult_set_busy(ult, 0);
+	return 1;
+}
+
+void ult_park_asm(struct current_thread_info *ult, struct ult_task *task);
+
+/* called by ult_park_asm on the pool thread's stack after the ULT state has
+ * been saved, returns nonzero if the task is already done */
+int ult_park_commit(struct current_thread_info *ult, struct ult_task *task) {
+	struct current_thread_info *expected = NULL;
+	return !__atomic_compare_exchange_n(&task->state, &expected, ult, 0,
+	                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static struct ult_task *pool_offload_async(void (*fn)(void *), void *arg) {
+	struct ult_task *task = malloc(sizeof(*task));
+	memset(task, 0, sizeof(*task));
+	task->fn = fn;
+	task->arg = arg;
+	if (current == NULL || current->blocking) {
+		/* no thread pool to offload to, or no pool thread to wait on */
+		fn(arg);
+		task->state = TASK_DONE;
+		return task;
+	}
+	ult_enqueue(ult_select(ULT_SLOW, current->pool_thread),
+	            (struct current_thread_info *)((uintptr_t) task | TASK_TAG));
+	return task;
+}
+
+static void pool_offload_wait(struct ult_task *task) {
+	if (__atomic_load_n(&task->state, __ATOMIC_SEQ_CST) != TASK_DONE) {
+		/* the pool thread runs other ULTs until the task completes */
+		ult_set_busy(current, 1);
+		ult_park_asm(current, task);
+		ult_set_busy(current, 0);
+	}
+	free(task);
+}
+
+static void pool_offload(void (*fn)(void *), void *arg) {
+	pool_offload_wait(pool_offload_async(fn, arg));
+}
+
+static void pool_post(enum ult_thread_type type, void (*fn)(void *), void *arg) {
+	assert(type >= 0 && type < ULT_TYPE_MAX);
+	struct ult_work *work = malloc(sizeof(*work));
+	work->fn.post = fn;
+	work->arg = arg;
+	ult_work_push(&posted[type], work);
+	ult_wake_all(type);
+}
+
+static void pool_background(enum ult_thread_type type, int (*fn)(void *), void *arg) {
+	assert(type >= 0 && type < ULT_TYPE_MAX);
+	struct ult_work *work = malloc(sizeof(*work));
+	work->fn.background = fn;
+	work->arg = arg;
+	ult_work_push(&background[type], work);
+	ult_wake_all(type);
+}
+
+static int pool_background_should_yield(void) {
+	struct thread_pool_info *pool_thread = background_pool;
+	int i;
+	if (pool_thread == NULL) {
+		return 0;
+	}
+	for (i = 0; i < 8; i++) {
+		if (__atomic_load_n(&pool_thread->queue[i], __ATOMIC_RELAXED) != NULL) {
+			return 1;
+		}
+	}
+	return __atomic_load_n(&posted[pool_thread->type].head,
+	                       __ATOMIC_RELAXED) != NULL;
+}
+
+static void pool_blocking_begin(void) {
+	if (current == NULL || current->blocking++ > 0) {
+		return;
+	}
+	/* hand the ULT back to its original kernel-level thread, so that the
+	 * pool thread can run other ULTs while this one blocks */
+	current->blocking_type = current->pool_thread->type;
+	ult_set_busy(current, 1);
+	ult_unregister_asm(current);
+	ult_set_busy(current, 0);
+}
+
+static void pool_blocking_end(void) {
+	if (current == NULL || current->blocking == 0 ||
+	    --current->blocking > 0) {
+		return;
+	}
+	ult_set_busy(current, 1);
+	ult_register_asm(current, ult_select(current->blocking_type, NULL));
+	ult_set_busy(current, 0);
+}
+
+static int pool_registered(void) {
 	return current != NULL;
 }
+
+static int pool_threads(enum ult_thread_type type, pid_t *tids, int max) {
+	int i, n = 0, size = __atomic_load_n(&pool_size[type], __ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&klt_count, __ATOMIC_ACQUIRE) == 0) {
+		return 0;
+	}
+	for (i = 0; i < size; i++) {
+		/* set by the pool thread itself once it runs */
+		pid_t tid = __atomic_load_n(&pool[type][i].tid, __ATOMIC_RELAXED);
+		if (tid != 0 && n < max) {
+			tids[n++] = tid;
+		}
+	}
+	return n;
+}
+
+/* backends */
+
+static void ult_probe_monitor(void) {
+	static char line[64] __attribute__((aligned(64)));
+	__monitor(line);
+}
+
+static void ult_probe_fsbase(void) {
+	uintptr_t fsbase;
+	__asm volatile("rdfsbase %0" : "=r" (fsbase));
+}
+
+static int ult_probe_futex(void) {
+	/* the context switches save and restore the fs base */
+	return ult_probe_instruction(ult_probe_fsbase);
+}
+
+static int ult_probe_mwait(void) {
+	/* monitor and mwait are either both enabled for user space or not */
+	return ult_probe_futex() && ult_probe_instruction(ult_probe_monitor);
+}
+
+static void ult_setup_futex(void) {
+	idle_futex = 1;
+}
+
+#define ULT_POOL_BACKEND \
+	.caps = ULT_CAP_MIGRATE | ULT_CAP_POOL | ULT_CAP_SIGNAL | ULT_CAP_THREADS, \
+	.init = pool_init, \
+	.deinit = pool_deinit, \
+	.register_klt = pool_register_klt, \
+	.unregister_klt = pool_unregister_klt, \
+	.migrate = pool_migrate, \
+	.migrate_benefit = pool_migrate_benefit, \
+	.migrate_from_signal = pool_migrate_from_signal, \
+	.offload = pool_offload, \
+	.offload_async = pool_offload_async, \
+	.offload_wait = pool_offload_wait, \
+	.background = pool_background, \
+	.background_should_yield = pool_background_should_yield, \
+	.blocking_begin = pool_blocking_begin, \
+	.blocking_end = pool_blocking_end, \
+	.pool_ref = pool_ref, \
+	.pool_unref = pool_unref, \
+	.post = pool_post, \
+	.registered = pool_registered, \
+	.pool_threads = pool_threads
+
+const struct ult_backend ult_backend_mwait = {
+	.name = "mwait",
+	.fallback = "futex",
+	.probe = ult_probe_mwait,
+	ULT_POOL_BACKEND,
+};
+
+const struct ult_backend ult_backend_futex = {
+	.name = "futex",
+	.fallback = "dummy",
+	.probe = ult_probe_futex,
+	.setup = ult_setup_futex,
+	ULT_POOL_BACKEND,
+};
@@ -18,6 +18,7 @@
 #define ULTMIGRATRION_H_INCLUDED
 
 #include <stdint.h>
+#include <sys/types.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -29,10 +30,88 @@ enum ult_thread_type {
 	ULT_TYPE_MAX
 };
 
+/* Capabilities of the backends, see ult_backend_caps(). */
+/* threads run on a core of the requested type */
+#define ULT_CAP_MIGRATE   0x01
+/* the thread's own core changes its frequency instead */
+#define ULT_CAP_FREQUENCY 0x02
+/* offloaded, posted and background work runs on pool threads */
+#define ULT_CAP_POOL      0x04
+/* ult_migrate_from_signal() works */
+#define ULT_CAP_SIGNAL    0x08
+/* more than one thread may register at a time */
+#define ULT_CAP_THREADS   0x10
+
+/* Selects the implementation: "mwait" (pool threads waiting with user space
+ * MWAIT), "futex" (pool threads waiting on a futex), "affinity" (the kernel
+ * migrates the thread with sched_setaffinity()), "pstate" (changes the P-state
+ * of the thread's core) or "dummy" (does nothing). Without a call,
+ * $ULT_BACKEND or "mwait" is used. If a backend doesn't work on this system,
+ * its fallback is used instead: mwait falls back to futex, and the others to
+ * dummy. Returns 0 on success, or -1 if another backend is already
+ * in use, i.e., after the first call of any other function. */
+int ult_set_backend(const char *name);
+const char *ult_backend_name(void);
+unsigned ult_backend_caps(void);
+
+/* Starts the pool threads and keeps them running until ult_deinit(). Without
+ * it, the pool threads start with the first registered thread and stop after
+ * the last one unregisters. Registration is lock-free while they run. */
+void ult_init(void);
+void ult_deinit(void);
 void ult_register_klt(void);
 void ult_unregister_klt(void);
 void ult_migrate(enum ult_thread_type);
+/* Like ult_migrate(), but competes with other threads for the destination.
+ * When several threads wait for the same core, the one with the highest
+ * benefit runs first. If the destination is busy and enough threads are
+ * already waiting, the thread stays on its current core instead. Returns the
+ * type of core the thread runs on afterwards. */
+enum ult_thread_type ult_migrate_benefit(enum ult_thread_type, double benefit);
+/* Migrates from a signal handler that interrupted the ULT. The handler has to
+ * be installed with SA_NODEFER because it returns on a different kernel-level
+ * thread, which would otherwise keep the signal blocked. Returns 0 without
+ * migrating if the signal interrupted libultmigration itself or arrived on a
+ * thread that doesn't run a ULT. */
+int ult_migrate_from_signal(enum ult_thread_type);
+
+/* Runs fn(arg) on the ULT_SLOW pool thread, e.g., for memory-bound work. While
+ * waiting, the caller's pool thread is free to run other ULTs. Without a
+ * registered thread, the function runs directly. */
+void ult_offload(void (*fn)(void *), void *arg);
+struct ult_task;
+/* Like ult_offload(), but returns immediately. ult_offload_wait() waits for
+ * completion and frees the handle; every handle has to be waited for. */
+struct ult_task *ult_offload_async(void (*fn)(void *), void *arg);
+void ult_offload_wait(struct ult_task *task);
+
+/* Submits low-priority work to the pool thread of the given type. The pool
+ * thread runs it while it has no ULT to run. The function should return soon
+ * after ult_background_should_yield() becomes nonzero; it is called again
+ * later if it returns nonzero. Tasks only run while threads are registered. */
+void ult_background(enum ult_thread_type type, int (*fn)(void *), void *arg);
+int ult_background_should_yield(void);
+
+/* Surround blocking calls, e.g., read(), with these functions. The thread
+ * returns to its original kernel-level thread until ult_blocking_end(), so
+ * that its pool thread can run other threads meanwhile. Calls may nest.
+ * Migrations in between take effect at ult_blocking_end(). */
+void ult_blocking_begin(void);
+void ult_blocking_end(void);
+
+/* Keeps the pool threads running without registering a thread, e.g., for
+ * ult_post(). Must not be called by pool threads. */
+void ult_pool_ref(void);
+void ult_pool_unref(void);
+/* Runs fn(arg) on the pool thread of the given type and returns immediately.
+ * Posted work runs after queued ULTs but before background work. The pool
+ * threads must be running, see ult_pool_ref(). */
+void ult_post(enum ult_thread_type type, void (*fn)(void *), void *arg);
 int ult_registered(void);
+/* Stores the thread ids of up to `max` running pool threads of the given type,
+ * including retired ones, e.g., for sampling them. Returns how many it stored,
+ * 0 for backends without ULT_CAP_POOL. */
+int ult_pool_threads(enum ult_thread_type type, pid_t *tids, int max);
 
 #ifdef __cplusplus
 }
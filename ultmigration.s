@@ -116,9 +116,15 @@ ult_migrate_asm:
 1:
 	add $1, %rcx
 	and $7, %rcx
-	lock cmpxchg %rdi, 24(%rsi, %rcx, 8) /* wakes up the destination */
+	lock cmpxchg %rdi, (%rsi, %rcx, 8) /* wakes up the destination */
 	jnz 1b
 
+	/* wake up the destination if it sleeps on a futex instead */
+	push %rdx
+	mov %rsi, %rdi
+	call ult_notify@PLT
+	pop %rdx
+
 	/* let this kernel-level thread wait for the next ULT */
 	mov %rdx, %rdi
 	jmp pick_next_thread
@@ -141,9 +147,9 @@ ult_register_asm:
 	/* save stack pointer in user-level thread struct */
 	mov %rsp, 8(%rdi)
 
-	/* switch stack */
+	/* switch stack to the end of aux_thread */
 	mov %rdi, %rax
-	add $0x1010, %rax
+	add $0x10010, %rax
 	mov %rax, %rsp
 
 	/* align stack */
@@ -156,9 +162,15 @@ ult_register_asm:
 1:
 	add $1, %rcx
 	and $7, %rcx
-	lock cmpxchg %rdi, 24(%rsi, %rcx, 8) /* wakes up the destination */
+	lock cmpxchg %rdi, (%rsi, %rcx, 8) /* wakes up the destination */
 	jnz 1b
 
+	/* wake up the destination if it sleeps on a futex instead */
+	push %rdi
+	mov %rsi, %rdi
+	call ult_notify@PLT
+	pop %rdi
+
 	/* wait for the ULT to finish */
 	push %rdi
 	call ult_wait_for_unregister@PLT
@@ -196,3 +208,44 @@ ult_unregister_asm:
 
 	jmp pick_next_thread
 
+.global ult_park_asm
+	/* rdi = current ULT, rsi = task the ULT waits for */
+ult_park_asm:
+	/* push callee-saved registers to the stack */
+	sub $64, %rsp
+	rdfsbase %rax
+	mov %rax, 56(%rsp)
+	rdgsbase %rax
+	mov %rax, 48(%rsp)
+	mov %rbp, 40(%rsp)
+	mov %rbx, 32(%rsp)
+	mov %r12, 24(%rsp)
+	mov %r13, 16(%rsp)
+	mov %r14, 8(%rsp)
+	mov %r15, 0(%rsp)
+
+	/* save stack pointer in user-level thread struct */
+	mov %rsp, 8(%rdi)
+
+	/* switch stack, the task may resume the ULT as soon as it is parked */
+	mov (%rdi), %rdx /* current kernel-level thread */
+	mov 64(%rdx), %rsp
+
+	/* register as waiter of the task */
+	push %rdi
+	push %rdx
+	sub $8, %rsp
+	call ult_park_commit@PLT
+	add $8, %rsp
+	pop %rdx
+	pop %rdi
+
+	test %rax, %rax
+	jnz 1f
+	/* parked, let this kernel-level thread run other ULTs */
+	mov %rdx, %rdi
+	jmp pick_next_thread
+1:
+	/* the task has already completed, continue */
+	mov 8(%rdi), %rsp
+	jmp restore_thread
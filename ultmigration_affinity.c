@@ -0,0 +1,128 @@
+/*
+ * Copyright © 2018, Lukas Werling
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* libultmigration backend that migrates with sched_setaffinity(), letting the
+ * kernel move the thread. Baseline for the user space context switches of
+ * the other backends. */
+#define _GNU_SOURCE
+#include "ultmigration_backend.h"
+#include "topo/cputopo.h"
+#include <assert.h>
+#include <sched.h>
+#include <stdlib.h>
+
+// CPUs of each core class, from FAST_CPU and SLOW_CPU or the topology.
+static cpu_set_t class_cpus[ULT_TYPE_MAX];
+
+static __thread int registered = 0;
+static __thread enum ult_thread_type current_type;
+// Set while affinity_migrate() runs, so that a signal handler doesn't change
+// the affinity between the current_type update and the system call.
+static __thread volatile int busy;
+// Affinity before registration, restored by affinity_unregister_klt().
+static __thread cpu_set_t saved_cpus;
+
+static int affinity_parse(const char *list, cpu_set_t *cpus) {
+	CPU_ZERO(cpus);
+	while (*list != '\0') {
+		char *end;
+		long cpu = strtol(list, &end, 10);
+		if (end == list || cpu < 0 || cpu >= CPU_SETSIZE)
+			return -1;
+		CPU_SET(cpu, cpus);
+		list = *end == ',' ? end + 1 : end;
+	}
+	return CPU_COUNT(cpus) > 0 ? 0 : -1;
+}
+
+static int affinity_probe(void) {
+	const char *fast = cputopo_class_cpus(0), *slow = cputopo_class_cpus(1);
+	return fast != NULL && slow != NULL &&
+	       affinity_parse(fast, &class_cpus[ULT_FAST]) == 0 &&
+	       affinity_parse(slow, &class_cpus[ULT_SLOW]) == 0;
+}
+
+static void affinity_migrate(enum ult_thread_type type) {
+	assert(type >= 0 && type < ULT_TYPE_MAX);
+	if (!registered || current_type == type)
+		return;
+	busy = 1;
+	current_type = type;
+	// The kernel moves the thread before returning if its current CPU is
+	// not in the set.
+	sched_setaffinity(0, sizeof(cpu_set_t), &class_cpus[type]);
+	busy = 0;
+}
+
+static void affinity_register_klt(void) {
+	sched_getaffinity(0, sizeof(cpu_set_t), &saved_cpus);
+	// Start on the fast cores like the pool backends.
+	current_type = ULT_TYPE_MAX;
+	registered = 1;
+	affinity_migrate(ULT_FAST);
+}
+
+static void affinity_unregister_klt(void) {
+	if (!registered)
+		return;
+	registered = 0;
+	sched_setaffinity(0, sizeof(cpu_set_t), &saved_cpus);
+}
+
+// There are no pool threads to compete for.
+static enum ult_thread_type affinity_migrate_benefit(enum ult_thread_type type, double benefit) {
+	(void) benefit;
+	affinity_migrate(type);
+	return type;
+}
+
+// sched_setaffinity() is a plain system call and safe in signal handlers, but
+// the signal must not interrupt a migration in progress.
+static int affinity_migrate_from_signal(enum ult_thread_type type) {
+	if (!registered || busy)
+		return 0;
+	affinity_migrate(type);
+	return 1;
+}
+
+static int affinity_registered(void) { return registered; }
+
+const struct ult_backend ult_backend_affinity = {
+	.name = "affinity",
+	.caps = ULT_CAP_MIGRATE | ULT_CAP_SIGNAL | ULT_CAP_THREADS,
+	.fallback = "dummy",
+	.probe = affinity_probe,
+	.init = ult_inline_nop,
+	.deinit = ult_inline_nop,
+	.register_klt = affinity_register_klt,
+	.unregister_klt = affinity_unregister_klt,
+	.migrate = affinity_migrate,
+	.migrate_benefit = affinity_migrate_benefit,
+	.migrate_from_signal = affinity_migrate_from_signal,
+	.offload = ult_inline_offload,
+	.offload_async = ult_inline_offload_async,
+	.offload_wait = ult_inline_offload_wait,
+	.background = ult_inline_background,
+	.background_should_yield = ult_inline_background_should_yield,
+	// The kernel schedules other threads while this one blocks anyway.
+	.blocking_begin = ult_inline_nop,
+	.blocking_end = ult_inline_nop,
+	.pool_ref = ult_inline_nop,
+	.pool_unref = ult_inline_nop,
+	.post = ult_inline_post,
+	.registered = affinity_registered,
+	.pool_threads = ult_inline_pool_threads,
+};
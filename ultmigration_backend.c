@@ -0,0 +1,247 @@
+/*
+ * Copyright © 2018, Lukas Werling
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* libultmigration API: selects a backend and forwards the calls to it. */
+#define _GNU_SOURCE
+#include "ultmigration_backend.h"
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const struct ult_backend *const backends[] = {
+	&ult_backend_mwait,
+	&ult_backend_futex,
+	&ult_backend_affinity,
+	&ult_backend_pstate,
+	&ult_backend_dummy,
+};
+
+static const struct ult_backend *backend;
+static const char *requested;
+static pthread_mutex_t backend_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const struct ult_backend *ult_find_backend(const char *name) {
+	size_t i;
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		if (strcmp(backends[i]->name, name) == 0) {
+			return backends[i];
+		}
+	}
+	return NULL;
+}
+
+static sigjmp_buf probe_env;
+
+static void ult_probe_handler(int sig) {
+	(void) sig;
+	siglongjmp(probe_env, 1);
+}
+
+int ult_probe_instruction(void (*fn)(void)) {
+	struct sigaction action, old;
+	int ok = 0;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = ult_probe_handler;
+	sigaction(SIGILL, &action, &old);
+	if (sigsetjmp(probe_env, 1) == 0) {
+		fn();
+		ok = 1;
+	}
+	sigaction(SIGILL, &old, NULL);
+	return ok;
+}
+
+/* there is no slow-core pool thread, offloaded functions run directly */
+struct ult_task { int done; };
+static struct ult_task completed_task = { 1 };
+
+void ult_inline_nop(void) { }
+void ult_inline_offload(void (*fn)(void *), void *arg) { fn(arg); }
+struct ult_task *ult_inline_offload_async(void (*fn)(void *), void *arg) {
+	fn(arg);
+	return &completed_task;
+}
+void ult_inline_offload_wait(struct ult_task *task) { (void) task; }
+
+/* without pool threads, background work runs to completion immediately */
+void ult_inline_background(enum ult_thread_type type, int (*fn)(void *), void *arg) {
+	(void) type;
+	while (fn(arg));
+}
+int ult_inline_background_should_yield(void) { return 0; }
+void ult_inline_post(enum ult_thread_type type, void (*fn)(void *), void *arg) {
+	(void) type;
+	fn(arg);
+}
+int ult_inline_pool_threads(enum ult_thread_type type, pid_t *tids, int max) {
+	(void) type;
+	(void) tids;
+	(void) max;
+	return 0;
+}
+
+/* Picks the requested backend or the first working fallback. */
+static const struct ult_backend *ult_choose_backend(void) {
+	const char *name = requested;
+	if (name == NULL) {
+		name = getenv("ULT_BACKEND");
+	}
+	if (name == NULL || *name == '\0') {
+		name = "mwait";
+	}
+	const struct ult_backend *b = ult_find_backend(name);
+	if (b == NULL) {
+		fprintf(stderr, "ultmigration: unknown backend %s (mwait, futex, affinity, pstate, dummy)\n", name);
+		exit(-1);
+	}
+	while (!b->probe()) {
+		const struct ult_backend *next = ult_find_backend(b->fallback);
+		fprintf(stderr, "ultmigration: backend %s not available, using %s\n",
+		        b->name, next->name);
+		b = next;
+	}
+	if (b->setup != NULL) {
+		b->setup();
+	}
+	return b;
+}
+
+static const struct ult_backend *ult_select_backend_slow(void) {
+	pthread_mutex_lock(&backend_mutex);
+	if (backend == NULL) {
+		__atomic_store_n(&backend, ult_choose_backend(), __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&backend_mutex);
+	return backend;
+}
+
+static inline const struct ult_backend *ult_backend(void) {
+	const struct ult_backend *b = __atomic_load_n(&backend, __ATOMIC_ACQUIRE);
+	if (__builtin_expect(b == NULL, 0)) {
+		b = ult_select_backend_slow();
+	}
+	return b;
+}
+
+int ult_set_backend(const char *name) {
+	int ret = 0;
+	if (ult_find_backend(name) == NULL) {
+		return -1;
+	}
+	pthread_mutex_lock(&backend_mutex);
+	if (backend == NULL) {
+		requested = name;
+		__atomic_store_n(&backend, ult_choose_backend(), __ATOMIC_RELEASE);
+	} else if (strcmp(backend->name, name) != 0) {
+		ret = -1;
+	}
+	pthread_mutex_unlock(&backend_mutex);
+	return ret;
+}
+
+const char *ult_backend_name(void) {
+	return ult_backend()->name;
+}
+
+unsigned ult_backend_caps(void) {
+	return ult_backend()->caps;
+}
+
+void ult_init(void) {
+	ult_backend()->init();
+}
+
+void ult_deinit(void) {
+	ult_backend()->deinit();
+}
+
+void ult_register_klt(void) {
+	ult_backend()->register_klt();
+}
+
+void ult_unregister_klt(void) {
+	ult_backend()->unregister_klt();
+}
+
+void ult_migrate(enum ult_thread_type type) {
+	ult_backend()->migrate(type);
+}
+
+enum ult_thread_type ult_migrate_benefit(enum ult_thread_type type, double benefit) {
+	return ult_backend()->migrate_benefit(type, benefit);
+}
+
+/* no thread is registered before a backend is selected, and selecting one in
+ * a signal handler would not be async-signal-safe */
+int ult_migrate_from_signal(enum ult_thread_type type) {
+	const struct ult_backend *b = __atomic_load_n(&backend, __ATOMIC_ACQUIRE);
+	return b != NULL ? b->migrate_from_signal(type) : 0;
+}
+
+void ult_offload(void (*fn)(void *), void *arg) {
+	ult_backend()->offload(fn, arg);
+}
+
+struct ult_task *ult_offload_async(void (*fn)(void *), void *arg) {
+	return ult_backend()->offload_async(fn, arg);
+}
+
+void ult_offload_wait(struct ult_task *task) {
+	ult_backend()->offload_wait(task);
+}
+
+void ult_background(enum ult_thread_type type, int (*fn)(void *), void *arg) {
+	ult_backend()->background(type, fn, arg);
+}
+
+int ult_background_should_yield(void) {
+	return ult_backend()->background_should_yield();
+}
+
+void ult_blocking_begin(void) {
+	ult_backend()->blocking_begin();
+}
+
+void ult_blocking_end(void) {
+	ult_backend()->blocking_end();
+}
+
+void ult_pool_ref(void) {
+	ult_backend()->pool_ref();
+}
+
+void ult_pool_unref(void) {
+	ult_backend()->pool_unref();
+}
+
+void ult_post(enum ult_thread_type type, void (*fn)(void *), void *arg) {
+	ult_backend()->post(type, fn, arg);
+}
+
+/* called by ultmigration_blocking.c for every wrapped call, which must not
+ * select a backend in processes that never register */
+int ult_registered(void) {
+	const struct ult_backend *b = __atomic_load_n(&backend, __ATOMIC_ACQUIRE);
+	return b != NULL && b->registered();
+}
+
+int ult_pool_threads(enum ult_thread_type type, pid_t *tids, int max) {
+	return ult_backend()->pool_threads(type, tids, max);
+}
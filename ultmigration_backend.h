@@ -0,0 +1,81 @@
+/*
+ * Copyright © 2018, Lukas Werling
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Interface between the libultmigration API in ultmigration_backend.c and the
+ * implementations of the API. */
+#ifndef ULTMIGRATION_BACKEND_H_INCLUDED
+#define ULTMIGRATION_BACKEND_H_INCLUDED
+
+#include "ultmigration.h"
+
+struct ult_backend {
+	const char *name;
+	/* ULT_CAP_* flags */
+	unsigned caps;
+	/* backend to try if this one is not available, or NULL */
+	const char *fallback;
+	/* returns nonzero if the backend works on this system */
+	int (*probe)(void);
+	/* called once when the backend is selected, may be NULL */
+	void (*setup)(void);
+
+	void (*init)(void);
+	void (*deinit)(void);
+	void (*register_klt)(void);
+	void (*unregister_klt)(void);
+	void (*migrate)(enum ult_thread_type);
+	enum ult_thread_type (*migrate_benefit)(enum ult_thread_type, double);
+	int (*migrate_from_signal)(enum ult_thread_type);
+	void (*offload)(void (*fn)(void *), void *);
+	struct ult_task *(*offload_async)(void (*fn)(void *), void *);
+	void (*offload_wait)(struct ult_task *);
+	void (*background)(enum ult_thread_type, int (*fn)(void *), void *);
+	int (*background_should_yield)(void);
+	void (*blocking_begin)(void);
+	void (*blocking_end)(void);
+	void (*pool_ref)(void);
+	void (*pool_unref)(void);
+	void (*post)(enum ult_thread_type, void (*fn)(void *), void *);
+	int (*registered)(void);
+	int (*pool_threads)(enum ult_thread_type, pid_t *, int);
+};
+
+/* ultmigration.c */
+extern const struct ult_backend ult_backend_mwait;
+extern const struct ult_backend ult_backend_futex;
+/* ultmigration_affinity.c */
+extern const struct ult_backend ult_backend_affinity;
+/* ultmigration_pstate.c */
+extern const struct ult_backend ult_backend_pstate;
+/* ultmigration_dummy.c */
+extern const struct ult_backend ult_backend_dummy;
+
+/* Returns nonzero if fn() runs without SIGILL, e.g., for instructions that
+ * the kernel has to enable for user space. */
+int ult_probe_instruction(void (*fn)(void));
+
+/* Implementations for backends without pool threads, which run offloaded,
+ * background and posted functions directly on the calling thread. */
+void ult_inline_nop(void);
+void ult_inline_offload(void (*fn)(void *), void *arg);
+struct ult_task *ult_inline_offload_async(void (*fn)(void *), void *arg);
+void ult_inline_offload_wait(struct ult_task *task);
+void ult_inline_background(enum ult_thread_type type, int (*fn)(void *), void *arg);
+int ult_inline_background_should_yield(void);
+void ult_inline_post(enum ult_thread_type type, void (*fn)(void *), void *arg);
+int ult_inline_pool_threads(enum ult_thread_type type, pid_t *tids, int max);
+
+#endif
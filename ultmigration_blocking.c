@@ -0,0 +1,276 @@
+/*
+ * Copyright © 2018, Lukas Werling
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* LD_PRELOAD library that wraps blocking library calls of registered threads
+ * in ult_blocking_begin()/ult_blocking_end(), so that a thread waiting for
+ * I/O does not occupy its pool thread. Calls on file descriptors are only
+ * wrapped if poll() reports that they would block, which is skipped for
+ * regular files. Raw futex system calls are out of scope, glibc issues them
+ * directly without a symbol to interpose; mutexes, condition variables and
+ * semaphores built on them are wrapped instead. */
+
+#define _GNU_SOURCE
+#include "ultmigration.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static void *next_symbol(const char *name) {
+	void *sym = dlsym(RTLD_NEXT, name);
+	if (sym == NULL) {
+		fprintf(stderr, "ultmigration_blocking: %s not found\n", name);
+		exit(-1);
+	}
+	return sym;
+}
+
+/* defines `real` as the next definition of the wrapped function */
+#define REAL(name) \
+	static __typeof__(name) *real; \
+	if (real == NULL) real = next_symbol(#name)
+
+/* runs `call` outside of the thread pool, preserving errno */
+#define BLOCKING(type, call) \
+	do { \
+		type ret; \
+		int saved_errno; \
+		ult_blocking_begin(); \
+		ret = call; \
+		saved_errno = errno; \
+		ult_blocking_end(); \
+		errno = saved_errno; \
+		return ret; \
+	} while (0)
+
+/* whether low file descriptors refer to regular files, which never block, so
+ * that read() and write() on them don't need a poll() each. Entries are reset
+ * when the descriptor is closed. */
+#define FD_CACHE_SIZE 1024
+enum { FD_UNKNOWN, FD_REGULAR, FD_OTHER };
+static unsigned char fd_kind[FD_CACHE_SIZE];
+
+static void forget_fd(int fd) {
+	if (fd >= 0 && fd < FD_CACHE_SIZE) {
+		__atomic_store_n(&fd_kind[fd], FD_UNKNOWN, __ATOMIC_RELAXED);
+	}
+}
+
+static int is_regular(int fd) {
+	if (fd < 0 || fd >= FD_CACHE_SIZE) {
+		return 0;
+	}
+	unsigned char kind = __atomic_load_n(&fd_kind[fd], __ATOMIC_RELAXED);
+	if (kind == FD_UNKNOWN) {
+		struct stat st;
+		if (fstat(fd, &st) < 0) {
+			return 0;
+		}
+		kind = S_ISREG(st.st_mode) ? FD_REGULAR : FD_OTHER;
+		__atomic_store_n(&fd_kind[fd], kind, __ATOMIC_RELAXED);
+	}
+	return kind == FD_REGULAR;
+}
+
+static int would_block(int fd, short events) {
+	struct pollfd pfd = { .fd = fd, .events = events };
+	return ult_registered() && !is_regular(fd) && poll(&pfd, 1, 0) == 0;
+}
+
+ssize_t read(int fd, void *buf, size_t count) {
+	REAL(read);
+	if (!would_block(fd, POLLIN)) {
+		return real(fd, buf, count);
+	}
+	BLOCKING(ssize_t, real(fd, buf, count));
+}
+
+ssize_t write(int fd, const void *buf, size_t count) {
+	REAL(write);
+	if (!would_block(fd, POLLOUT)) {
+		return real(fd, buf, count);
+	}
+	BLOCKING(ssize_t, real(fd, buf, count));
+}
+
+ssize_t recv(int fd, void *buf, size_t len, int flags) {
+	REAL(recv);
+	if ((flags & MSG_DONTWAIT) || !would_block(fd, POLLIN)) {
+		return real(fd, buf, len, flags);
+	}
+	BLOCKING(ssize_t, real(fd, buf, len, flags));
+}
+
+ssize_t recvfrom(int fd, void *buf, size_t len, int flags,
+                 struct sockaddr *src_addr, socklen_t *addrlen) {
+	REAL(recvfrom);
+	if ((flags & MSG_DONTWAIT) || !would_block(fd, POLLIN)) {
+		return real(fd, buf, len, flags, src_addr, addrlen);
+	}
+	BLOCKING(ssize_t, real(fd, buf, len, flags, src_addr, addrlen));
+}
+
+int accept(int fd, struct sockaddr *addr, socklen_t *addrlen) {
+	REAL(accept);
+	if (!would_block(fd, POLLIN)) {
+		return real(fd, addr, addrlen);
+	}
+	BLOCKING(int, real(fd, addr, addrlen));
+}
+
+int accept4(int fd, struct sockaddr *addr, socklen_t *addrlen, int flags) {
+	REAL(accept4);
+	if (!would_block(fd, POLLIN)) {
+		return real(fd, addr, addrlen, flags);
+	}
+	BLOCKING(int, real(fd, addr, addrlen, flags));
+}
+
+/* the remaining calls are wrapped unless they cannot block */
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+	REAL(poll);
+	if (timeout == 0 || !ult_registered()) {
+		return real(fds, nfds, timeout);
+	}
+	BLOCKING(int, real(fds, nfds, timeout));
+}
+
+int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
+           struct timeval *timeout) {
+	REAL(select);
+	if ((timeout != NULL && timeout->tv_sec == 0 && timeout->tv_usec == 0) ||
+	    !ult_registered()) {
+		return real(nfds, readfds, writefds, exceptfds, timeout);
+	}
+	BLOCKING(int, real(nfds, readfds, writefds, exceptfds, timeout));
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout) {
+	REAL(epoll_wait);
+	if (timeout == 0 || !ult_registered()) {
+		return real(epfd, events, maxevents, timeout);
+	}
+	BLOCKING(int, real(epfd, events, maxevents, timeout));
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem) {
+	REAL(nanosleep);
+	if (!ult_registered()) {
+		return real(req, rem);
+	}
+	BLOCKING(int, real(req, rem));
+}
+
+int usleep(useconds_t usec) {
+	REAL(usleep);
+	if (!ult_registered()) {
+		return real(usec);
+	}
+	BLOCKING(int, real(usec));
+}
+
+unsigned int sleep(unsigned int seconds) {
+	REAL(sleep);
+	if (!ult_registered()) {
+		return real(seconds);
+	}
+	BLOCKING(unsigned int, real(seconds));
+}
+
+int sem_wait(sem_t *sem) {
+	REAL(sem_wait);
+	if (!ult_registered()) {
+		return real(sem);
+	}
+	if (sem_trywait(sem) == 0) {
+		return 0;
+	}
+	BLOCKING(int, real(sem));
+}
+
+int pthread_mutex_lock(pthread_mutex_t *mutex) {
+	REAL(pthread_mutex_lock);
+	if (!ult_registered()) {
+		return real(mutex);
+	}
+	if (pthread_mutex_trylock(mutex) == 0) {
+		return 0;
+	}
+	BLOCKING(int, real(mutex));
+}
+
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+	REAL(pthread_cond_wait);
+	if (!ult_registered()) {
+		return real(cond, mutex);
+	}
+	BLOCKING(int, real(cond, mutex));
+}
+
+int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                           const struct timespec *abstime) {
+	REAL(pthread_cond_timedwait);
+	if (!ult_registered()) {
+		return real(cond, mutex, abstime);
+	}
+	BLOCKING(int, real(cond, mutex, abstime));
+}
+
+int pthread_join(pthread_t thread, void **retval) {
+	REAL(pthread_join);
+	if (!ult_registered()) {
+		return real(thread, retval);
+	}
+	BLOCKING(int, real(thread, retval));
+}
+
+/* descriptors closed here may be reused for something else than a regular
+ * file. fclose() closes internally, so it is wrapped as well. */
+
+int close(int fd) {
+	REAL(close);
+	forget_fd(fd);
+	return real(fd);
+}
+
+int fclose(FILE *stream) {
+	REAL(fclose);
+	forget_fd(fileno(stream));
+	return real(stream);
+}
+
+int dup2(int oldfd, int newfd) {
+	REAL(dup2);
+	forget_fd(newfd);
+	return real(oldfd, newfd);
+}
+
+int dup3(int oldfd, int newfd, int flags) {
+	REAL(dup3);
+	forget_fd(newfd);
+	return real(oldfd, newfd, flags);
+}
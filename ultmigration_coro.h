@@ -0,0 +1,199 @@
+/*
+ * Copyright © 2018, Lukas Werling
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ULTMIGRATION_CORO_H_INCLUDED
+#define ULTMIGRATION_CORO_H_INCLUDED
+
+// Coroutine interface to libultmigration, requires C++20.
+//
+//     ult::executor ex;
+//     ex.spawn([]() -> ult::task {
+//         parse_request();
+//         co_await ult::on(ULT_SLOW);
+//         scan_table();
+//         co_await ult::on(ULT_FAST);
+//         ...
+//     });
+//     ex.wait();
+//
+// Coroutines run on the pool threads directly, so a pool thread drives any
+// number of them and no ULT is needed per coroutine. They must not block,
+// otherwise migrating threads cannot use the pool thread either.
+
+#include "ultmigration.h"
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+namespace ult {
+
+namespace detail {
+
+// Core class of the pool thread running the current coroutine. Pool threads
+// run tasks with their own TLS, so this is per pool thread.
+inline thread_local int current_class = -1;
+
+template <int type>
+void resume_on(void *address) {
+	current_class = type;
+	std::coroutine_handle<>::from_address(address).resume();
+}
+
+inline void post(enum ult_thread_type type, std::coroutine_handle<> h) {
+	static void (*const resume[ULT_TYPE_MAX])(void *) = {
+		&resume_on<ULT_FAST>, &resume_on<ULT_SLOW>,
+	};
+	static_assert(ULT_TYPE_MAX == 2, "missing core class in resume table");
+	ult_post(type, resume[type], h.address());
+}
+
+}
+
+class executor;
+
+// Fire-and-forget coroutine started by executor::spawn() or start(). Another
+// task can also co_await it, which runs it to completion on the same thread.
+class task {
+public:
+	struct promise_type {
+		executor *owner = nullptr;
+		// Coroutine awaiting this one, resumed when it finishes.
+		std::coroutine_handle<> continuation;
+
+		task get_return_object() {
+			return task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		auto final_suspend() noexcept;
+		void return_void() { }
+		void unhandled_exception() { std::terminate(); }
+	};
+
+	task(task&& other) : handle(std::exchange(other.handle, nullptr)) { }
+	task(const task&) = delete;
+	~task() {
+		if (handle) handle.destroy();
+	}
+
+	auto operator co_await() && noexcept {
+		struct awaiter {
+			std::coroutine_handle<promise_type> handle;
+
+			bool await_ready() const noexcept { return false; }
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) noexcept {
+				handle.promise().continuation = h;
+				return handle;
+			}
+			void await_resume() const noexcept { }
+		};
+		return awaiter{handle};
+	}
+
+private:
+	friend class executor;
+	explicit task(std::coroutine_handle<promise_type> h) : handle(h) { }
+	std::coroutine_handle<promise_type> handle;
+};
+
+// Awaitable returned by on(). Resumes the coroutine on a pool thread of the
+// given core class, or continues directly if it already runs there.
+struct on_awaitable {
+	enum ult_thread_type type;
+
+	bool await_ready() const noexcept { return detail::current_class == type; }
+	void await_suspend(std::coroutine_handle<> h) const { detail::post(type, h); }
+	void await_resume() const noexcept { }
+};
+
+inline on_awaitable on(enum ult_thread_type type) {
+	return on_awaitable{type};
+}
+
+// Keeps the pool threads alive and tracks spawned coroutines. The destructor
+// waits for all of them. Must not be used from a pool thread or a registered
+// thread, as waiting blocks the calling thread.
+class executor {
+public:
+	executor() { ult_pool_ref(); }
+	~executor() {
+		wait();
+		ult_pool_unref();
+	}
+	executor(const executor&) = delete;
+	executor& operator=(const executor&) = delete;
+
+	// Starts a coroutine on a pool thread of the given core class. The
+	// callable is kept alive until the coroutine finishes, so it may be a
+	// lambda with captures.
+	template <typename Fn>
+	void spawn(Fn fn, enum ult_thread_type type = ULT_FAST) {
+		start(invoke(std::move(fn)), type);
+	}
+
+	void start(task t, enum ult_thread_type type = ULT_FAST) {
+		auto h = std::exchange(t.handle, nullptr);
+		h.promise().owner = this;
+		running.fetch_add(1);
+		detail::post(type, h);
+	}
+
+	// Waits until all spawned coroutines have finished.
+	void wait() {
+		long n;
+		while ((n = running.load()) != 0) running.wait(n);
+	}
+
+private:
+	friend struct task::promise_type;
+
+	// Coroutine parameters live in the frame, unlike the closure object the
+	// caller passed to spawn().
+	template <typename Fn>
+	static task invoke(Fn fn) {
+		co_await fn();
+	}
+
+	void finished() {
+		if (running.fetch_sub(1) == 1) running.notify_all();
+	}
+
+	std::atomic<long> running{0};
+};
+
+inline auto task::promise_type::final_suspend() noexcept {
+	// An awaited task resumes the awaiting coroutine, whose task object
+	// destroys the frame. Otherwise, the frame destroys itself after notifying
+	// the executor.
+	struct awaiter {
+		bool await_ready() noexcept { return false; }
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+			if (h.promise().continuation)
+				return h.promise().continuation;
+			executor *owner = h.promise().owner;
+			h.destroy();
+			owner->finished();
+			return std::noop_coroutine();
+		}
+		void await_resume() noexcept { }
+	};
+	return awaiter{};
+}
+
+}
+
+#endif
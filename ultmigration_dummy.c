@@ -14,15 +14,52 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-/* Does nothing.
- * Useful for benchmarks and for running on systems without user space MWAIT.
+/* Backend that does nothing.
+ * Useful for benchmarks and as the last fallback on systems where the other
+ * backends don't work.
  */
-#include "ultmigration.h"
+#include "ultmigration_backend.h"
 
-static int registered = 0;
+static __thread int registered = 0;
 
-void ult_register_klt(void) { registered = 1; }
-void ult_unregister_klt(void) { registered = 0; }
-void ult_migrate(enum ult_thread_type type) { }
-int ult_registered(void) { return registered; }
+static void dummy_register_klt(void) { registered = 1; }
+static void dummy_unregister_klt(void) { registered = 0; }
+static void dummy_migrate(enum ult_thread_type type) { (void) type; }
+static enum ult_thread_type dummy_migrate_benefit(enum ult_thread_type type, double benefit) {
+	(void) benefit;
+	return type;
+}
+/* without ULT_CAP_SIGNAL, callers must not count on a migration */
+static int dummy_migrate_from_signal(enum ult_thread_type type) {
+	(void) type;
+	return 0;
+}
 
+static int dummy_registered(void) { return registered; }
+
+static int dummy_probe(void) { return 1; }
+
+const struct ult_backend ult_backend_dummy = {
+	.name = "dummy",
+	.caps = ULT_CAP_THREADS,
+	.probe = dummy_probe,
+	.init = ult_inline_nop,
+	.deinit = ult_inline_nop,
+	.register_klt = dummy_register_klt,
+	.unregister_klt = dummy_unregister_klt,
+	.migrate = dummy_migrate,
+	.migrate_benefit = dummy_migrate_benefit,
+	.migrate_from_signal = dummy_migrate_from_signal,
+	.offload = ult_inline_offload,
+	.offload_async = ult_inline_offload_async,
+	.offload_wait = ult_inline_offload_wait,
+	.background = ult_inline_background,
+	.background_should_yield = ult_inline_background_should_yield,
+	.blocking_begin = ult_inline_nop,
+	.blocking_end = ult_inline_nop,
+	.pool_ref = ult_inline_nop,
+	.pool_unref = ult_inline_nop,
+	.post = ult_inline_post,
+	.registered = dummy_registered,
+	.pool_threads = ult_inline_pool_threads,
+};
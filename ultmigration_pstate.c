@@ -14,67 +14,240 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-/* libultmigration API implementation that changes P-states on one core instead of migrating. */
+/* libultmigration backend that changes the P-state of the thread's core
+ * instead of migrating. Every registered thread is pinned to the core it
+ * registers on and switches that core. The P-state is written to the PStateCtl
+ * MSR through /dev/cpu/N/msr on Ryzen, or to scaling_setspeed of the userspace
+ * cpufreq governor otherwise. */
 #define _GNU_SOURCE
-#include "ultmigration.h"
+#include "ultmigration_backend.h"
+#include "tools/msrtools.h"
 #include <assert.h>
+#include <cpuid.h>
+#include <fcntl.h>
 #include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
-static int registered = 0;
-static int pstates[8]; // Ryzen supports max. 8 P-states. The array maps pstate number to cpufreq frequency.
-static int pstate_max = 0; // Maximum valid index in pstates
+static const uint32_t
+	PStateCtl  = 0xc0010062,
+	PStateStat = 0xc0010063;
+
+static int use_msr; // Write PStateCtl instead of scaling_setspeed.
+static int collect_stats; // $ULT_PSTATE_STATS
 static int pstate_fast, pstate_slow; // P-state indices for ULT_FAST/ULT_SLOW
-static FILE *setspeed; // scaling_setspeed file
 
-void ult_register_klt(void) {
-	assert(!registered && "can't register more than one thread");
-	registered = 1;
+// State of a registered thread.
+struct pstate_thread {
+	int registered;
+	// set during pstate_migrate(), see pstate_migrate_from_signal()
+	volatile int busy;
+	int cpu;
+	enum ult_thread_type type;
+	// affinity before registration, restored by pstate_unregister_klt()
+	cpu_set_t saved_cpus;
+	// scaling_setspeed and the frequencies to write for ULT_FAST/ULT_SLOW,
+	// without use_msr
+	int setspeed;
+	char frequency[ULT_TYPE_MAX][16];
+	// switch latency with $ULT_PSTATE_STATS
+	unsigned long switches;
+	uint64_t write_ns, write_max_ns, settle_ns, settle_max_ns;
+};
+static __thread struct pstate_thread thread;
 
-	// Pin the thread to the currently active CPU.
+static uint64_t pstate_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// PStateCtl exists on AMD family 17h and later.
+static int pstate_msr_available(int cpu) {
+	unsigned eax, ebx, ecx, edx;
+	char path[64];
+	if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx) || ebx != signature_AMD_ebx)
+		return 0;
+	__get_cpuid(1, &eax, &ebx, &ecx, &edx);
+	unsigned family = (eax >> 8) & 0xf;
+	if (family == 0xf)
+		family += (eax >> 20) & 0xff;
+	if (family < 0x17)
+		return 0;
+	snprintf(path, sizeof(path), "/dev/cpu/%d/msr", cpu);
+	return access(path, R_OK | W_OK) == 0;
+}
+
+static int pstate_sysfs_available(int cpu) {
+	char path[100];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_setspeed", cpu);
+	return access(path, W_OK) == 0;
+}
+
+// Needs the P-state indices and either MSR access or the userspace cpufreq
+// governor. $ULT_PSTATE_MODE (msr or sysfs) restricts the choice.
+static int pstate_probe(void) {
+	const char *mode = getenv("ULT_PSTATE_MODE");
 	int cpu = sched_getcpu();
-	cpu_set_t cpus;
-	CPU_ZERO(&cpus);
-	CPU_SET(cpu, &cpus);
-	sched_setaffinity(0, sizeof(cpus), &cpus);
+	if (getenv("SLOW_IDX") == NULL || getenv("FAST_IDX") == NULL)
+		return 0;
+	if ((mode == NULL || strcmp(mode, "sysfs") != 0) && pstate_msr_available(cpu)) {
+		use_msr = 1;
+		return 1;
+	}
+	use_msr = 0;
+	return (mode == NULL || strcmp(mode, "msr") != 0) && pstate_sysfs_available(cpu);
+}
+
+static void pstate_setup(void) {
+	pstate_slow = atoi(getenv("SLOW_IDX"));
+	pstate_fast = atoi(getenv("FAST_IDX"));
+	assert(pstate_slow >= 0 && pstate_slow < 8 && pstate_fast >= 0 && pstate_fast < 8 && "invalid index");
+	collect_stats = getenv("ULT_PSTATE_STATS") != NULL;
+}
 
-	// Open the thread's P-state control file.
+// Reads the frequencies of the P-states from scaling_available_frequencies.
+static void pstate_open_sysfs(void) {
 	char filename[100];
-	sprintf(filename, "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_available_frequencies", cpu);
+	int pstates[8];
+	sprintf(filename, "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_available_frequencies", thread.cpu);
 	FILE *f = fopen(filename, "r"); assert(f && "couldn't open scaling_available_frequencies");
-	pstate_max = fscanf(f, "%d %d %d %d %d %d %d %d", &pstates[0], &pstates[1], &pstates[2], &pstates[3], &pstates[4], &pstates[5], &pstates[6], &pstates[7]) - 1;
+	int pstate_max = fscanf(f, "%d %d %d %d %d %d %d %d", &pstates[0], &pstates[1], &pstates[2], &pstates[3], &pstates[4], &pstates[5], &pstates[6], &pstates[7]) - 1;
 	assert(pstate_max > 0 && "didn't read any P-states from scaling_available_frequencies");
+	assert(pstate_slow <= pstate_max && pstate_fast <= pstate_max && "invalid index");
 	fclose(f);
+	snprintf(thread.frequency[ULT_FAST], sizeof(thread.frequency[0]), "%d\n", pstates[pstate_fast]);
+	snprintf(thread.frequency[ULT_SLOW], sizeof(thread.frequency[0]), "%d\n", pstates[pstate_slow]);
+
+	sprintf(filename, "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_setspeed", thread.cpu);
+	thread.setspeed = open(filename, O_WRONLY); assert(thread.setspeed >= 0 && "couldn't open scaling_setspeed");
+}
+
+static void pstate_register_klt(void) {
+	assert(!thread.registered && "thread is already registered");
+	memset(&thread, 0, sizeof(thread));
+	thread.registered = 1;
+	thread.type = ULT_TYPE_MAX;
+
+	// Pin the thread to the currently active CPU.
+	sched_getaffinity(0, sizeof(thread.saved_cpus), &thread.saved_cpus);
+	thread.cpu = sched_getcpu();
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(thread.cpu, &cpus);
+	sched_setaffinity(0, sizeof(cpus), &cpus);
 
-	sprintf(filename, "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_setspeed", cpu);
-	setspeed = fopen(filename, "w"); assert(setspeed && "couldn't open scaling_setspeed");
+	if (!use_msr) {
+		pstate_open_sysfs();
+		return;
+	}
+	// msrtools.c keeps the fd open, so that switching is a single pwrite().
+	int err = msr_open(thread.cpu);
+	if (err) {
+		fprintf(stderr, "ultmigration: pstate: /dev/cpu/%d/msr: %s\n", thread.cpu, strerror(-err));
+		exit(-1);
+	}
+}
 
-	// Read fast/slow P-state indices from environment.
-	char *slow_idx = getenv("SLOW_IDX");
-	char *fast_idx = getenv("FAST_IDX");
-	assert(slow_idx != NULL && fast_idx != NULL && "SLOW_IDX or FAST_IDX environment variable not set");
-	pstate_slow = atoi(slow_idx);
-	pstate_fast = atoi(fast_idx);
-	assert(pstate_slow >= 0 && pstate_slow <= pstate_max && pstate_fast >= 0 && pstate_fast <= pstate_max && "invalid index");
+static void pstate_unregister_klt(void) {
+	if (!thread.registered)
+		return;
+	thread.registered = 0;
+	sched_setaffinity(0, sizeof(thread.saved_cpus), &thread.saved_cpus);
+	if (!use_msr)
+		close(thread.setspeed);
+	if (collect_stats && thread.switches > 0) {
+		fprintf(stderr, "ultmigration: pstate CPU %d: %lu switches, write %.0f ns (max %"PRIu64")",
+		        thread.cpu, thread.switches, (double) thread.write_ns / thread.switches, thread.write_max_ns);
+		if (use_msr)
+			fprintf(stderr, ", settled after %.0f ns (max %"PRIu64")",
+			        (double) thread.settle_ns / thread.switches, thread.settle_max_ns);
+		fprintf(stderr, "\n");
+	}
 }
 
-void ult_unregister_klt(void) {
-	assert(registered && "not previously registered");
-	registered = 0;
-	fclose(setspeed);
+static void pstate_write(enum ult_thread_type type) {
+	if (use_msr)
+		msr_write(thread.cpu, PStateCtl, type == ULT_FAST ? pstate_fast : pstate_slow);
+	else
+		pwrite(thread.setspeed, thread.frequency[type], strlen(thread.frequency[type]), 0);
 }
 
-void ult_migrate(enum ult_thread_type type) {
-	int frequency;
-	switch (type) {
-	case ULT_FAST: frequency = pstates[pstate_fast]; break;
-	case ULT_SLOW: frequency = pstates[pstate_slow]; break;
-	default: assert(!"invalid type");
+static void pstate_migrate(enum ult_thread_type type) {
+	assert(type >= 0 && type < ULT_TYPE_MAX && "invalid type");
+	if (!thread.registered || thread.type == type)
+		return;
+	thread.busy = 1;
+	thread.type = type;
+	if (!collect_stats) {
+		pstate_write(type);
+		thread.busy = 0;
+		return;
+	}
+	uint64_t start = pstate_now_ns();
+	pstate_write(type);
+	uint64_t written = pstate_now_ns(), settled = written;
+	if (use_msr) {
+		// Wait until PStateStat reports the new P-state, at most 1 ms.
+		uint64_t pstate = type == ULT_FAST ? pstate_fast : pstate_slow, stat;
+		while (msr_read(thread.cpu, PStateStat, &stat) == 0 && (stat & 0x7) != pstate &&
+		       settled - written < 1000000)
+			settled = pstate_now_ns();
 	}
-	fprintf(setspeed, "%d\n", frequency);
-	fflush(setspeed);
+	thread.switches++;
+	thread.write_ns += written - start;
+	if (written - start > thread.write_max_ns)
+		thread.write_max_ns = written - start;
+	thread.settle_ns += settled - start;
+	if (settled - start > thread.settle_max_ns)
+		thread.settle_max_ns = settled - start;
+	thread.busy = 0;
+}
+
+// Each thread switches its own core, so there is nothing to arbitrate.
+static enum ult_thread_type pstate_migrate_benefit(enum ult_thread_type type, double benefit) {
+	(void) benefit;
+	pstate_migrate(type);
+	return type;
+}
+
+// pwrite() is async-signal-safe, but the signal must not
+// interrupt a switch in progress.
+static int pstate_migrate_from_signal(enum ult_thread_type type) {
+	if (!thread.registered || thread.busy)
+		return 0;
+	pstate_migrate(type);
+	return 1;
 }
 
-int ult_registered(void) { return registered; }
+static int pstate_registered(void) { return thread.registered; }
 
+const struct ult_backend ult_backend_pstate = {
+	.name = "pstate",
+	.caps = ULT_CAP_FREQUENCY | ULT_CAP_SIGNAL | ULT_CAP_THREADS,
+	.fallback = "dummy",
+	.probe = pstate_probe,
+	.setup = pstate_setup,
+	.init = ult_inline_nop,
+	.deinit = ult_inline_nop,
+	.register_klt = pstate_register_klt,
+	.unregister_klt = pstate_unregister_klt,
+	.migrate = pstate_migrate,
+	.migrate_benefit = pstate_migrate_benefit,
+	.migrate_from_signal = pstate_migrate_from_signal,
+	.offload = ult_inline_offload,
+	.offload_async = ult_inline_offload_async,
+	.offload_wait = ult_inline_offload_wait,
+	.background = ult_inline_background,
+	.background_should_yield = ult_inline_background_should_yield,
+	.blocking_begin = ult_inline_nop,
+	.blocking_end = ult_inline_nop,
+	.pool_ref = ult_inline_nop,
+	.pool_unref = ult_inline_nop,
+	.post = ult_inline_post,
+	.registered = pstate_registered,
+	.pool_threads = ult_inline_pool_threads,
+};